@@ -0,0 +1,741 @@
+// augmentfs_fsck.cpp - offline verify/seal of a backing directory.
+//
+// Usage:
+//   augmentfs-fsck [--seal] [--schema=file|block|both] [-j N] [-o OPTS] <backing_dir>
+//
+// Walks <backing_dir> and checks every regular file against <backing_dir>/.metadata.db:
+//   default   verify: report files whose data no longer matches their stored
+//             checksums. The DB is only read.
+//   --seal    (re)seal: compute each file's checksums and store them, replacing
+//             whatever was stored. Rows of files that no longer exist are dropped.
+// --schema picks what is checked or written: `file` is the whole-file schema
+// (metadatafs), `block` the per-block schema (blockfs), `both` (default) both.
+// -o takes the shared db_*, checksum= and log_level= options, as for the mounts.
+//
+// Nothing may be mounted on <backing_dir> while this runs: the filesystems
+// assume nobody else writes their DB.
+//
+// Exit status: 0 = nothing wrong (or sealed), 1 = mismatches found,
+// 2 = usage or I/O errors.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "checksum.h"
+#include "db_options.h"
+#include "log.h"
+#include "schema.h"
+
+// --- CONFIGURATION ---
+static const size_t FSCK_READ_SIZE = 1024 * 1024;     // bytes per read, a multiple of BLOCK_SIZE
+static const size_t SEAL_CHUNK_BLOCKS = 8192;         // block hashes per message to the writer
+static const size_t SEAL_QUEUE_MAX = 256;             // messages buffered before workers wait
+static const size_t SEAL_COMMIT_ROWS = 256 * 1024;    // rows per transaction
+static const int SEAL_COMMIT_SECS = 5;                // ...or this old, whichever comes first
+static const size_t BAD_BLOCKS_SHOWN = 8;             // per file
+
+enum SchemaSel { SCHEMA_FILE = 1, SCHEMA_BLOCK = 2, SCHEMA_BOTH = 3 };
+
+static std::string backing_root;
+static int root_fd = -1;
+static std::string db_path;
+static bool seal_mode = false;
+static int schemas = SCHEMA_BOTH;
+static unsigned nthreads = 0;
+
+// --- REPORTING ---
+
+static std::atomic<uint64_t> files_done{0};
+static std::atomic<uint64_t> bytes_done{0};
+static std::atomic<uint64_t> files_bad{0};       // data does not match its checksums
+static std::atomic<uint64_t> files_unsealed{0};  // no checksum stored (verify)
+static std::atomic<uint64_t> files_failed{0};    // could not be read, or changed while read
+static std::atomic<bool> walk_incomplete{false};  // a directory could not be listed
+
+static std::mutex report_mutex;
+
+static void report(const std::string& line) {
+    std::lock_guard<std::mutex> lock(report_mutex);
+    std::cout << line << '\n';
+}
+
+// --- WORK-STEALING POOL ---
+// Tasks are directories to list and files to check. Each worker owns a deque:
+// it pushes what it discovers to the back and pops from the back, so it works
+// depth-first and the queues stay short on wide trees. An idle worker steals
+// from the front of another worker's deque, which holds the oldest, usually
+// largest, pending subtrees. One huge directory or file therefore never
+// leaves the other workers without work for long.
+
+struct Task {
+    std::string path;  // relative to the backing root, as a mount path ("/a/b")
+    bool is_dir;
+};
+
+struct WorkerQueue {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+};
+
+static std::vector<std::unique_ptr<WorkerQueue>> queues;
+// Idle workers and the main thread sleep on idle_cv. The counts change only
+// under idle_mutex, so no wakeup is lost between a check and the wait.
+static std::mutex idle_mutex;
+static std::condition_variable idle_cv;  // a task was queued, or none is pending
+static size_t tasks_pending = 0;         // queued or running
+static size_t tasks_queued = 0;          // in some deque, not yet popped
+
+static void push_task(size_t self, Task task) {
+    {
+        // Counted first, so a pop never runs ahead of the count
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        tasks_pending++;
+        tasks_queued++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[self]->mtx);
+        queues[self]->tasks.push_back(std::move(task));
+    }
+    idle_cv.notify_one();
+}
+
+static bool pop_task(size_t self, Task& out) {
+    {
+        WorkerQueue& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mtx);
+        if (!own.tasks.empty()) {
+            out = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+        WorkerQueue& victim = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mtx);
+        if (!victim.tasks.empty()) {
+            out = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+// --- SEAL WRITER ---
+// Only one thread writes the DB. Workers hand it their results through a
+// bounded queue and it applies them in large transactions, so sealing costs a
+// commit per SEAL_COMMIT_ROWS rows instead of one per file.
+
+struct SealMsg {
+    enum Kind { BLOCKS, DONE, ABORT, SKIP } kind = SKIP;
+    std::string path;
+    int64_t first_block = 0;          // BLOCKS
+    std::vector<uint64_t> hashes;     // BLOCKS
+    uint64_t checksum = 0;            // DONE: whole-file checksum
+    FileFingerprint fst = {};         // DONE
+    uint64_t nblocks = 0;             // DONE
+};
+
+static SealMsg seal_msg(SealMsg::Kind kind, const std::string& path) {
+    SealMsg m;
+    m.kind = kind;
+    m.path = path;
+    return m;
+}
+
+static SealMsg seal_blocks(const std::string& path, int64_t first_block,
+                           std::vector<uint64_t> hashes) {
+    SealMsg m = seal_msg(SealMsg::BLOCKS, path);
+    m.first_block = first_block;
+    m.hashes = std::move(hashes);
+    return m;
+}
+
+static std::mutex seal_mutex;
+static std::condition_variable seal_cv;       // writer: queue not empty / finished
+static std::condition_variable seal_room_cv;  // workers: queue not full
+static std::deque<SealMsg> seal_queue;
+static bool seal_finished = false;
+
+static void seal_send(SealMsg msg) {
+    std::unique_lock<std::mutex> lock(seal_mutex);
+    seal_room_cv.wait(lock, [] { return seal_queue.size() < SEAL_QUEUE_MAX; });
+    seal_queue.push_back(std::move(msg));
+    lock.unlock();
+    seal_cv.notify_one();
+}
+
+enum SealStmt {
+    SEAL_INSERT_FILE,
+    SEAL_FILE_ID,
+    SEAL_CLEAR_TREE,
+    SEAL_CLEAR_ROOT,
+    SEAL_STAGE_BLOCK,
+    SEAL_COPY_STAGED,
+    SEAL_DROP_STAGED,
+    SEAL_TRIM_BLOCKS,
+    SEAL_SET_CHECKSUM,
+    SEAL_SEEN,
+    SEAL_STMT_COUNT
+};
+
+static const char* const SEAL_SQL[SEAL_STMT_COUNT] = {
+    "INSERT OR IGNORE INTO files(path) VALUES(?);",
+    "SELECT file_id FROM files WHERE path=?;",
+    "DELETE FROM merkle_nodes WHERE file_id=?;",
+    "UPDATE files SET merkle_root=NULL, verified_at=NULL WHERE file_id=?;",
+    "INSERT OR REPLACE INTO fsck_staged(stage, block_index, checksum) VALUES(?, ?, ?);",
+    "INSERT OR REPLACE INTO block_hashes(file_id, block_index, checksum, algo) "
+    "SELECT ?1, block_index, checksum, ?3 FROM fsck_staged WHERE stage=?2;",
+    "DELETE FROM fsck_staged WHERE stage=?;",
+    "DELETE FROM block_hashes WHERE file_id=? AND block_index >= ?;",
+    "INSERT INTO checksums(path, checksum, algo, size, mtime_ns, ctime_ns, ino) "
+    "VALUES(?, ?, ?, ?, ?, ?, ?) "
+    "ON CONFLICT(path) DO UPDATE SET checksum = excluded.checksum, algo = excluded.algo, "
+    "  size = excluded.size, mtime_ns = excluded.mtime_ns, "
+    "  ctime_ns = excluded.ctime_ns, ino = excluded.ino, verified_at = NULL;",
+    "INSERT OR IGNORE INTO fsck_seen(path) VALUES(?);",
+};
+
+// Rows for paths this run did not find. Quarantined files keep theirs.
+static const char* const SEAL_PRUNE_SQL =
+    "DELETE FROM merkle_nodes WHERE file_id IN (SELECT file_id FROM files f WHERE {GONE});"
+    "DELETE FROM block_hashes WHERE file_id IN (SELECT file_id FROM files f WHERE {GONE});"
+    "DELETE FROM files WHERE file_id IN (SELECT file_id FROM files f WHERE {GONE});"
+    "DELETE FROM checksums WHERE path IN (SELECT path FROM checksums f WHERE {GONE});";
+static const char* const SEAL_GONE_SQL =
+    "f.path NOT IN (SELECT path FROM fsck_seen) AND substr(f.path, 1, 13) != '/.quarantine/'";
+
+struct SealWriter {
+    sqlite3* db = nullptr;
+    sqlite3_stmt* stmt[SEAL_STMT_COUNT] = {};
+    // Block hashes of a file wait in the temp table fsck_staged until the file
+    // is DONE. A file that aborts keeps the rows it had.
+    std::unordered_map<std::string, int64_t> stages;
+    int64_t next_stage = 0;
+    size_t rows = 0;
+    std::chrono::steady_clock::time_point tx_started;
+};
+
+static void seal_exec(SealWriter& w, const char* sql) {
+    char* errmsg = nullptr;
+    if (sqlite3_exec(w.db, sql, nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LOGE("fsck: " << (errmsg ? errmsg : "?") << " (" << sql << ")");
+        sqlite3_free(errmsg);
+    }
+}
+
+static sqlite3_stmt* seal_stmt(SealWriter& w, SealStmt id) {
+    sqlite3_reset(w.stmt[id]);
+    sqlite3_clear_bindings(w.stmt[id]);
+    return w.stmt[id];
+}
+
+static void seal_step(SealWriter& w, sqlite3_stmt* stmt) {
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        LOGE("fsck: DB ERROR: " << sqlite3_errmsg(w.db));
+    }
+    w.rows++;
+}
+
+// file_id of `path` (inserted if new), with its Merkle tree dropped
+static int64_t seal_file_id(SealWriter& w, const std::string& path) {
+    sqlite3_stmt* s = seal_stmt(w, SEAL_INSERT_FILE);
+    sqlite3_bind_text(s, 1, path.c_str(), -1, SQLITE_STATIC);
+    seal_step(w, s);
+    s = seal_stmt(w, SEAL_FILE_ID);
+    sqlite3_bind_text(s, 1, path.c_str(), -1, SQLITE_STATIC);
+    int64_t id = sqlite3_step(s) == SQLITE_ROW ? sqlite3_column_int64(s, 0) : 0;
+    for (SealStmt clear : {SEAL_CLEAR_TREE, SEAL_CLEAR_ROOT}) {
+        s = seal_stmt(w, clear);
+        sqlite3_bind_int64(s, 1, id);
+        seal_step(w, s);
+    }
+    return id;
+}
+
+static int64_t seal_stage_of(SealWriter& w, const std::string& path) {
+    auto it = w.stages.find(path);
+    if (it != w.stages.end()) return it->second;
+    return w.stages[path] = w.next_stage++;
+}
+
+// DONE replaces the file's rows with what was read. ABORT (a read error, or
+// the file changed while it was read) leaves them alone: old checksums that
+// may no longer match are better than none, and a later seal or a rewrite
+// through the mount replaces them.
+static void seal_apply(SealWriter& w, const SealMsg& m) {
+    sqlite3_stmt* s;
+    if (m.kind != SealMsg::BLOCKS) {
+        s = seal_stmt(w, SEAL_SEEN);
+        sqlite3_bind_text(s, 1, m.path.c_str(), -1, SQLITE_STATIC);
+        seal_step(w, s);
+    }
+    if (m.kind == SealMsg::SKIP) return;
+
+    if (schemas & SCHEMA_BLOCK) {
+        int64_t stage = seal_stage_of(w, m.path);
+        if (m.kind == SealMsg::BLOCKS) {
+            s = seal_stmt(w, SEAL_STAGE_BLOCK);
+            for (size_t i = 0; i < m.hashes.size(); ++i) {
+                sqlite3_reset(s);
+                sqlite3_bind_int64(s, 1, stage);
+                sqlite3_bind_int64(s, 2, m.first_block + (int64_t)i);
+                sqlite3_bind_int64(s, 3, (sqlite3_int64)m.hashes[i]);
+                seal_step(w, s);
+            }
+            return;
+        }
+        if (m.kind == SealMsg::DONE) {
+            int64_t id = seal_file_id(w, m.path);
+            s = seal_stmt(w, SEAL_COPY_STAGED);
+            sqlite3_bind_int64(s, 1, id);
+            sqlite3_bind_int64(s, 2, stage);
+            sqlite3_bind_int64(s, 3, checksum_algo);
+            seal_step(w, s);
+            w.rows += sqlite3_changes(w.db);
+            s = seal_stmt(w, SEAL_TRIM_BLOCKS);
+            sqlite3_bind_int64(s, 1, id);
+            sqlite3_bind_int64(s, 2, (int64_t)m.nblocks);
+            seal_step(w, s);
+        }
+        s = seal_stmt(w, SEAL_DROP_STAGED);
+        sqlite3_bind_int64(s, 1, stage);
+        seal_step(w, s);
+        w.stages.erase(m.path);
+    }
+
+    if ((schemas & SCHEMA_FILE) && m.kind == SealMsg::DONE) {
+        s = seal_stmt(w, SEAL_SET_CHECKSUM);
+        sqlite3_bind_text(s, 1, m.path.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(s, 2, (sqlite3_int64)m.checksum);
+        sqlite3_bind_int64(s, 3, checksum_algo);
+        sqlite3_bind_int64(s, 4, m.fst.size);
+        sqlite3_bind_int64(s, 5, m.fst.mtime_ns);
+        sqlite3_bind_int64(s, 6, m.fst.ctime_ns);
+        sqlite3_bind_int64(s, 7, m.fst.ino);
+        seal_step(w, s);
+    }
+}
+
+static int seal_open(SealWriter& w) {
+    if (sqlite3_open(db_path.c_str(), &w.db) != SQLITE_OK) {
+        LOGE("fsck: cannot open " << db_path << ": " << sqlite3_errmsg(w.db));
+        return -1;
+    }
+    sqlite3_busy_timeout(w.db, 5000);
+    if (apply_db_options(w.db) != 0) return -1;
+    // Both, so every statement below prepares; --schema only limits what is written
+    if (create_checksums_schema(w.db) != 0 || create_block_schema(w.db) != 0) return -1;
+    seal_exec(w, "CREATE TEMP TABLE fsck_seen (path TEXT PRIMARY KEY);");
+    seal_exec(w, "CREATE TEMP TABLE fsck_staged (stage INTEGER, block_index INTEGER, checksum INTEGER,"
+                 " PRIMARY KEY(stage, block_index)) WITHOUT ROWID;");
+    for (int i = 0; i < SEAL_STMT_COUNT; ++i) {
+        if (sqlite3_prepare_v2(w.db, SEAL_SQL[i], -1, &w.stmt[i], nullptr) != SQLITE_OK) {
+            LOGE("fsck: prepare failed: " << sqlite3_errmsg(w.db) << " (" << SEAL_SQL[i] << ")");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void seal_writer_main(SealWriter* w) {
+    seal_exec(*w, "BEGIN IMMEDIATE;");
+    w->tx_started = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(seal_mutex);
+    for (;;) {
+        seal_cv.wait(lock, [] { return !seal_queue.empty() || seal_finished; });
+        if (seal_queue.empty()) break;
+        SealMsg m = std::move(seal_queue.front());
+        seal_queue.pop_front();
+        lock.unlock();
+        seal_room_cv.notify_one();
+
+        seal_apply(*w, m);
+        if (w->rows >= SEAL_COMMIT_ROWS ||
+            std::chrono::steady_clock::now() - w->tx_started >= std::chrono::seconds(SEAL_COMMIT_SECS)) {
+            seal_exec(*w, "COMMIT; BEGIN IMMEDIATE;");
+            w->rows = 0;
+            w->tx_started = std::chrono::steady_clock::now();
+        }
+        lock.lock();
+    }
+    lock.unlock();
+
+    // Only a complete walk knows which files are gone
+    if (walk_incomplete) {
+        LOGW("fsck: some directories could not be listed; rows of missing files are kept");
+        seal_exec(*w, "COMMIT;");
+        return;
+    }
+    std::string prune = SEAL_PRUNE_SQL;
+    for (size_t at; (at = prune.find("{GONE}")) != std::string::npos;) {
+        prune.replace(at, 6, SEAL_GONE_SQL);
+    }
+    if (!(schemas & SCHEMA_BLOCK)) prune = prune.substr(prune.find("DELETE FROM checksums"));
+    if (!(schemas & SCHEMA_FILE)) prune = prune.substr(0, prune.find("DELETE FROM checksums"));
+    seal_exec(*w, prune.c_str());
+    seal_exec(*w, "COMMIT;");
+}
+
+// --- VERIFY ---
+// Each worker reads the DB through a read-only connection of its own.
+
+struct VerifyDb {
+    sqlite3* db = nullptr;
+    sqlite3_stmt* get_checksum = nullptr;
+    sqlite3_stmt* get_file_id = nullptr;
+    sqlite3_stmt* get_blocks = nullptr;
+    ~VerifyDb() {
+        sqlite3_finalize(get_checksum);
+        sqlite3_finalize(get_file_id);
+        sqlite3_finalize(get_blocks);
+        if (db) sqlite3_close(db);
+    }
+};
+
+static VerifyDb* verify_db() {
+    static thread_local VerifyDb vdb;
+    if (vdb.db) return &vdb;
+    if (sqlite3_open_v2(db_path.c_str(), &vdb.db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        LOGE("fsck: cannot open " << db_path << ": " << sqlite3_errmsg(vdb.db));
+        return nullptr;
+    }
+    sqlite3_busy_timeout(vdb.db, 5000);
+    // A schema the DB does not have (yet) simply leaves its statement null
+    sqlite3_prepare_v2(vdb.db, "SELECT checksum, algo FROM checksums WHERE path=?;",
+                       -1, &vdb.get_checksum, nullptr);
+    sqlite3_prepare_v2(vdb.db, "SELECT file_id FROM files WHERE path=?;",
+                       -1, &vdb.get_file_id, nullptr);
+    sqlite3_prepare_v2(vdb.db, "SELECT block_index, checksum, algo FROM block_hashes "
+                               "WHERE file_id=? ORDER BY block_index;",
+                       -1, &vdb.get_blocks, nullptr);
+    return &vdb;
+}
+
+// --- CHECKING ONE FILE ---
+
+static bool is_db_file(const std::string& path) {
+    return path.compare(0, 13, "/.metadata.db") == 0;
+}
+
+// Read a regular file once. In seal mode its checksums go to the writer;
+// otherwise they are compared with the stored ones as the data streams by.
+static void check_file(const std::string& path) {
+    static thread_local std::vector<char> buf(FSCK_READ_SIZE);
+    const char* what = nullptr;  // why the file could not be checked
+
+    int fd = openat(root_fd, path.c_str() + 1, O_RDONLY | O_NOFOLLOW);
+    struct stat before, after;
+    if (fd == -1 || fstat(fd, &before) == -1) {
+        report("ERROR " + path + ": " + strerror(errno));
+        if (fd != -1) close(fd);
+        files_failed++;
+        if (seal_mode) seal_send(seal_msg(SealMsg::SKIP, path));
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Expected values (verify)
+    VerifyDb* vdb = seal_mode ? nullptr : verify_db();
+    bool have_whole = false, have_blocks = false, block_row = false;
+    uint64_t expected = 0;
+    ChecksumAlgo whole_algo = checksum_algo;
+    if (vdb && (schemas & SCHEMA_FILE) && vdb->get_checksum) {
+        sqlite3_bind_text(vdb->get_checksum, 1, path.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(vdb->get_checksum) == SQLITE_ROW &&
+            sqlite3_column_type(vdb->get_checksum, 0) != SQLITE_NULL) {
+            expected = (uint64_t)sqlite3_column_int64(vdb->get_checksum, 0);
+            if (checksum_from_id(sqlite3_column_int64(vdb->get_checksum, 1), whole_algo)) {
+                have_whole = true;
+            } else {
+                what = "unknown checksum algorithm";
+            }
+        }
+        sqlite3_reset(vdb->get_checksum);
+    }
+    if (vdb && (schemas & SCHEMA_BLOCK) && vdb->get_file_id && vdb->get_blocks) {
+        sqlite3_bind_text(vdb->get_file_id, 1, path.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(vdb->get_file_id) == SQLITE_ROW) {
+            sqlite3_bind_int64(vdb->get_blocks, 1, sqlite3_column_int64(vdb->get_file_id, 0));
+            have_blocks = true;
+            block_row = sqlite3_step(vdb->get_blocks) == SQLITE_ROW;
+        }
+        sqlite3_reset(vdb->get_file_id);
+    }
+
+    uint64_t whole = checksum_init(whole_algo);
+    std::vector<uint64_t> chunk;  // seal: block hashes not yet sent
+    std::vector<int64_t> bad_blocks;
+    size_t nbad = 0;
+    int64_t block_idx = 0, chunk_first = 0;
+    off_t off = 0;
+    for (bool eof = false; !eof;) {
+        // Fill the whole buffer so blocks stay aligned; only a 0 read is EOF
+        size_t n = 0;
+        while (n < FSCK_READ_SIZE) {
+            ssize_t got = pread(fd, buf.data() + n, FSCK_READ_SIZE - n, off + n);
+            if (got == -1 && errno == EINTR) continue;
+            if (got == -1) {
+                what = strerror(errno);
+                break;
+            }
+            if (got == 0) {
+                eof = true;
+                break;
+            }
+            n += got;
+        }
+        if (what || n == 0) break;
+        off += n;
+        bytes_done += n;
+        if (seal_mode || have_whole) checksum_update(whole_algo, whole, buf.data(), n);
+
+        for (size_t b = 0; b < n; b += BLOCK_SIZE, ++block_idx) {
+            size_t len = std::min<size_t>(BLOCK_SIZE, n - b);
+            if (seal_mode && (schemas & SCHEMA_BLOCK)) {
+                chunk.push_back(checksum_of(checksum_algo, buf.data() + b, len));
+                if (chunk.size() == SEAL_CHUNK_BLOCKS) {
+                    seal_send(seal_blocks(path, chunk_first, std::move(chunk)));
+                    chunk.clear();
+                    chunk_first = block_idx + 1;
+                }
+            }
+            if (!have_blocks) continue;
+            while (block_row && sqlite3_column_int64(vdb->get_blocks, 0) < block_idx) {
+                block_row = sqlite3_step(vdb->get_blocks) == SQLITE_ROW;
+            }
+            if (!block_row || sqlite3_column_int64(vdb->get_blocks, 0) != block_idx ||
+                sqlite3_column_type(vdb->get_blocks, 1) == SQLITE_NULL) {
+                continue;  // no hash stored: blockfs reads this block unverified
+            }
+            ChecksumAlgo algo;
+            if (!checksum_from_id(sqlite3_column_int64(vdb->get_blocks, 2), algo) ||
+                checksum_of(algo, buf.data() + b, len) !=
+                    (uint64_t)sqlite3_column_int64(vdb->get_blocks, 1)) {
+                if (bad_blocks.size() < BAD_BLOCKS_SHOWN) bad_blocks.push_back(block_idx);
+                nbad++;
+            }
+        }
+    }
+    if (vdb && vdb->get_blocks) sqlite3_reset(vdb->get_blocks);
+
+    if (!what && (fstat(fd, &after) == -1 || !(fingerprint_of(after) == fingerprint_of(before)))) {
+        what = "changed while it was read";
+    }
+    if (!what && off != after.st_size) what = "read ended before the end of the file";
+    close(fd);
+    files_done++;
+
+    if (seal_mode) {
+        if (what) {
+            report("ERROR " + path + ": " + what + "; stored checksums left as they were");
+            files_failed++;
+            seal_send(seal_msg(SealMsg::ABORT, path));
+            return;
+        }
+        if (!chunk.empty()) seal_send(seal_blocks(path, chunk_first, std::move(chunk)));
+        SealMsg done = seal_msg(SealMsg::DONE, path);
+        done.checksum = whole;
+        done.fst = fingerprint_of(after);
+        done.nblocks = ((uint64_t)after.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        seal_send(std::move(done));
+        return;
+    }
+
+    if (what) {
+        report("ERROR " + path + ": " + what);
+        files_failed++;
+        return;
+    }
+    bool bad = false;
+    if (have_whole && whole != expected) {
+        report("MISMATCH " + path + ": whole-file checksum");
+        bad = true;
+    }
+    if (nbad) {
+        std::string line = "MISMATCH " + path + ": " + std::to_string(nbad) + " block(s):";
+        for (int64_t b : bad_blocks) line += " " + std::to_string(b);
+        if (nbad > bad_blocks.size()) line += " ...";
+        report(line);
+        bad = true;
+    }
+    if (bad) files_bad++;
+    if (!have_whole && !have_blocks) {
+        report("UNSEALED " + path);
+        files_unsealed++;
+    }
+}
+
+// Queue the entries of a directory
+static void list_dir(size_t self, const std::string& path) {
+    int dfd = path == "/" ? openat(root_fd, ".", O_RDONLY | O_DIRECTORY)
+                          : openat(root_fd, path.c_str() + 1, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR* dp = dfd == -1 ? nullptr : fdopendir(dfd);
+    if (!dp) {
+        report("ERROR " + path + ": " + strerror(errno));
+        if (dfd != -1) close(dfd);
+        files_failed++;
+        walk_incomplete = true;
+        return;
+    }
+    std::string prefix = path == "/" ? "/" : path + "/";
+    struct dirent* de;
+    while ((de = readdir(dp)) != nullptr) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        std::string child = prefix + de->d_name;
+        if (path == "/" && (is_db_file(child) || child == "/.quarantine")) continue;
+
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) push_task(self, {child, true});
+        else if (type == DT_REG) push_task(self, {child, false});
+    }
+    closedir(dp);
+}
+
+static void worker_main(size_t self) {
+    Task task;
+    for (;;) {
+        if (pop_task(self, task)) {
+            {
+                std::lock_guard<std::mutex> lock(idle_mutex);
+                tasks_queued--;
+            }
+            if (task.is_dir) list_dir(self, task.path);
+            else check_file(task.path);
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            if (--tasks_pending == 0) idle_cv.notify_all();
+            continue;
+        }
+        // Queued but not in a deque yet (or just stolen): look again
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle_cv.wait(lock, [] { return tasks_queued > 0 || tasks_pending == 0; });
+        if (tasks_pending == 0) return;
+    }
+}
+
+// --- MAIN ---
+
+static void usage() {
+    std::cerr << "Usage: augmentfs-fsck [--seal] [--schema=file|block|both] [-j N] [-o OPTS] <backing_dir>\n";
+}
+
+static bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--seal") {
+            seal_mode = true;
+        } else if (arg.rfind("--schema=", 0) == 0) {
+            std::string v = arg.substr(9);
+            if (v == "file") schemas = SCHEMA_FILE;
+            else if (v == "block") schemas = SCHEMA_BLOCK;
+            else if (v == "both") schemas = SCHEMA_BOTH;
+            else return false;
+        } else if (arg == "-j" && i + 1 < argc) {
+            char* end = nullptr;
+            nthreads = strtoul(argv[++i], &end, 10);
+            if (*end || nthreads == 0) return false;
+        } else if (arg == "-o" && i + 1 < argc) {
+            std::string rest;
+            if (!strip_shared_options(argv[++i], rest)) return false;
+            if (!rest.empty()) {
+                LOGE("Unknown option: " << rest);
+                return false;
+            }
+        } else if (arg[0] != '-' && backing_root.empty()) {
+            backing_root = arg;
+        } else {
+            return false;
+        }
+    }
+    return !backing_root.empty();
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        usage();
+        return 2;
+    }
+    if (backing_root.size() > 1 && backing_root.back() == '/') backing_root.pop_back();
+    root_fd = open(backing_root.c_str(), O_RDONLY | O_DIRECTORY);
+    if (root_fd == -1) {
+        LOGE("Cannot open backing directory " << backing_root << ": " << strerror(errno));
+        return 2;
+    }
+    db_path = backing_root + "/.metadata.db";
+    if (!seal_mode && access(db_path.c_str(), R_OK) != 0) {
+        LOGE("No readable " << db_path << "; nothing to verify against");
+        return 2;
+    }
+    if (nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+
+    SealWriter writer;
+    std::thread writer_thread;
+    if (seal_mode) {
+        if (seal_open(writer) != 0) return 2;
+        writer_thread = std::thread(seal_writer_main, &writer);
+    }
+    LOGI((seal_mode ? "Sealing " : "Verifying ") << backing_root << " with " << nthreads
+         << " threads" << (seal_mode ? std::string(" (") + checksum_name(checksum_algo) + ")" : ""));
+
+    auto started = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < nthreads; ++i) queues.emplace_back(new WorkerQueue);
+    push_task(0, {"/", true});
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < nthreads; ++i) workers.emplace_back(worker_main, i);
+
+    // Progress while the workers run
+    {
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        while (!idle_cv.wait_for(lock, std::chrono::seconds(10), [] { return tasks_pending == 0; })) {
+            LOGI("fsck: " << files_done << " files, " << (bytes_done >> 20) << " MiB");
+        }
+    }
+    for (auto& t : workers) t.join();
+
+    if (seal_mode) {
+        {
+            std::lock_guard<std::mutex> lock(seal_mutex);
+            seal_finished = true;
+        }
+        seal_cv.notify_one();
+        writer_thread.join();
+        for (sqlite3_stmt* s : writer.stmt) sqlite3_finalize(s);
+        sqlite3_close(writer.db);
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    LOGI("fsck: " << files_done << " files, " << (bytes_done >> 20) << " MiB in " << secs << "s ("
+         << (uint64_t)(bytes_done / 1048576.0 / std::max(secs, 0.001)) << " MiB/s)");
+    if (!seal_mode) {
+        LOGI("fsck: " << files_bad << " mismatched, " << files_unsealed << " unsealed, "
+             << files_failed << " unreadable");
+    }
+    if (files_failed) return 2;
+    return files_bad ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+// backing_at.h - resolve mount paths inside the backing directory with *at()
+// calls, shared by metadatafs and blockfs.
+//
+// Building backing_root + path for every operation makes the kernel walk the
+// whole backing path again on each lstat/open. Instead, the backing root is
+// held open as an O_PATH fd, and so are recently used parent directories. An
+// operation on "/a/b/c/file" then resolves just "file" relative to the cached
+// fd for "/a/b/c".
+//
+// Cached directory fds are reference counted, so an entry can be replaced
+// while another thread is still using it. Renaming or removing a directory
+// must call backing_dir_invalidate() so that paths under it are looked up
+// again. The backing directory is owned by the mount; changes made to it
+// behind the mount's back are not tracked, just as the path-keyed DB rows
+// are not.
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+struct DirFd {
+    int fd;
+    explicit DirFd(int f) : fd(f) {}
+    ~DirFd() { if (fd >= 0) close(fd); }
+};
+
+typedef std::shared_ptr<DirFd> DirRef;
+
+// A mount path resolved to (directory fd, last component)
+struct AtPath {
+    DirRef dir;
+    const char* name;  // points into the mount path; "." for the root
+
+    int fd() const { return dir->fd; }
+};
+
+static DirRef backing_root_dir;
+
+static const size_t DIR_CACHE_SLOTS = 1024;
+
+struct DirSlot {
+    std::mutex mtx;
+    std::string path;  // mount path of the directory, e.g. "/a/b"
+    DirRef dir;
+};
+
+static DirSlot dir_cache[DIR_CACHE_SLOTS];
+static std::atomic<uint64_t> dir_cache_gen{0};  // bumped by every invalidation
+
+// Open the backing root. Call before fuse_main(): a bad backing directory then
+// fails the mount instead of every operation, and the fd survives daemonizing.
+static int backing_open_root(const std::string& root) {
+    int fd = open(root.c_str(), O_PATH | O_DIRECTORY);
+    if (fd == -1) return -errno;
+    backing_root_dir = std::make_shared<DirFd>(fd);
+    return 0;
+}
+
+static void backing_close_root() {
+    for (auto& slot : dir_cache) {
+        std::lock_guard<std::mutex> lock(slot.mtx);
+        slot.dir.reset();
+        slot.path.clear();
+    }
+    backing_root_dir.reset();
+}
+
+// Forget cached fds for `dir` and everything below it
+static void backing_dir_invalidate(std::string_view dir) {
+    dir_cache_gen++;
+    for (auto& slot : dir_cache) {
+        std::lock_guard<std::mutex> lock(slot.mtx);
+        if (!slot.dir) continue;
+        std::string_view p = slot.path;
+        if (p.size() >= dir.size() && p.compare(0, dir.size(), dir) == 0 &&
+            (p.size() == dir.size() || p[dir.size()] == '/')) {
+            slot.dir.reset();
+        }
+    }
+}
+
+// fd of the directory at mount path `dir` ("" is the root). Sets errno on failure.
+static DirRef backing_dir(std::string_view dir) {
+    if (dir.empty()) return backing_root_dir;
+
+    DirSlot& slot = dir_cache[std::hash<std::string_view>()(dir) % DIR_CACHE_SLOTS];
+    {
+        std::lock_guard<std::mutex> lock(slot.mtx);
+        if (slot.dir && slot.path == dir) return slot.dir;
+    }
+
+    uint64_t gen = dir_cache_gen;
+    std::string rel(dir.substr(1));
+    int fd = openat(backing_root_dir->fd, rel.c_str(), O_PATH | O_DIRECTORY);
+    if (fd == -1) return nullptr;
+    DirRef ref = std::make_shared<DirFd>(fd);
+
+    // Don't cache what a concurrent rename may already have made stale
+    std::lock_guard<std::mutex> lock(slot.mtx);
+    if (dir_cache_gen == gen) {
+        slot.path.assign(dir);
+        slot.dir = ref;
+    }
+    return ref;
+}
+
+// Resolve a FUSE path. Returns 0 or -errno.
+static int at_path(const char* path, AtPath& out) {
+    std::string_view p(path);
+    size_t slash = p.rfind('/');
+    if (slash == std::string_view::npos || p.size() == 1) {
+        out.dir = backing_root_dir;
+        out.name = ".";
+        return 0;
+    }
+    out.dir = backing_dir(p.substr(0, slash));
+    if (!out.dir) return -errno;
+    out.name = path + slash + 1;
+    return 0;
+}
@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 29
+#define FUSE_USE_VERSION 31
 #define _FILE_OFFSET_BITS 64
 
 #include <fuse.h>
@@ -17,26 +17,40 @@
 #include <cstring>
 #include <iomanip>
 #include <algorithm> // For std::min, std::max
-
-// --- CONFIGURATION ---
-static const size_t BLOCK_SIZE = 4096; // 4KB Blocks (Standard Page Size)
-static const uint64_t FNV_OFFSET_BASIS = 1469598103934665603ULL;
-static const uint64_t FNV_PRIME        = 1099511628211ULL;
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <unordered_set>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include "checksum.h"
+#include "db_options.h"
+#include "schema.h"
+#include "log.h"
+#include "fuse_conn.h"
+#include "backing_at.h"
+#include "scrub.h"
 
 // --- GLOBALS ---
 static sqlite3* meta_db = nullptr;
 static std::string backing_root;
 static std::vector<std::string> append_only_dirs; 
 
-// --- HELPERS ---
+// Group commit window for block hash updates (0 = commit at the end of every fs_write)
+static unsigned long commit_window_ms = 0;
+static unsigned long commit_window_kb = 0;
 
-static void update_fnv1a(uint64_t &hash, const char* buf, size_t size) {
-    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
-    for (size_t i = 0; i < size; ++i) {
-        hash ^= static_cast<uint64_t>(p[i]);
-        hash *= FNV_PRIME;
-    }
-}
+// Number of block checksums kept in memory (0 = no cache)
+static size_t block_cache_entries = 65536;
+
+// Threads hashing the blocks of one large write (0 = one per CPU, 1 = inline only)
+static unsigned long hash_threads = 0;
+
+// --- HELPERS ---
 
 static std::string full_path(const char* path) {
     std::string result = backing_root;
@@ -49,79 +63,1237 @@ static int64_t get_block_index(off_t offset) {
     return offset / BLOCK_SIZE;
 }
 
+// pread() until `count` bytes or EOF. Returns bytes read, or -1 with errno set.
+static ssize_t pread_full(int fd, char* buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pread(fd, buf + done, count - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// pwrite() all of `count` bytes. Returns bytes written, or -1 with errno set.
+static ssize_t pwrite_full(int fd, const char* buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pwrite(fd, buf + done, count - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// --- PREPARED STATEMENTS ---
+// Every statement blockfs runs is prepared once in fs_init_db and reused.
+// Hot paths (fs_read/fs_write) would otherwise re-parse the same SQL per block.
+
+enum StmtId {
+    STMT_LOOKUP_FILE_ID,
+    STMT_INSERT_FILE,
+    STMT_DELETE_FILE,
+    STMT_RENAME_FILE,
+    STMT_RENAME_CHILDREN,
+    STMT_GET_BLOCK_HASH,
+    STMT_SET_BLOCK_HASH,
+    STMT_DELETE_FILE_HASHES,
+    STMT_DELETE_HASHES_AFTER,
+    STMT_DELETE_METADATA,
+    STMT_GET_LEAVES,
+    STMT_GET_TREE_NODE,
+    STMT_SET_TREE_NODE,
+    STMT_DELETE_TREE,
+    STMT_GET_ROOT,
+    STMT_SET_ROOT,
+    STMT_CLEAR_ROOT,
+    STMT_SCRUB_FILES,
+    STMT_SET_VERIFIED,
+    STMT_GET_VERIFIED,
+    STMT_BEGIN,
+    STMT_COMMIT,
+    STMT_ROLLBACK,
+    STMT_COUNT
+};
+
+static const char* const STMT_SQL[STMT_COUNT] = {
+    "SELECT file_id FROM files WHERE path=?;",
+    "INSERT INTO files(path) VALUES(?);",
+    "DELETE FROM files WHERE file_id=?;",
+    "UPDATE files SET path=? WHERE file_id=?;",
+    // Everything under directory ?2 moves under ?1. '0' sorts right after '/',
+    // so the range scan stays on the path index.
+    "UPDATE files SET path = ?1 || substr(path, length(?2) + 1) "
+    "WHERE path > ?2 || '/' AND path < ?2 || '0';",
+    "SELECT checksum, algo FROM block_hashes WHERE file_id=? AND block_index=?;",
+    "INSERT OR REPLACE INTO block_hashes(file_id, block_index, checksum, algo) VALUES(?, ?, ?, ?);",
+    "DELETE FROM block_hashes WHERE file_id=?;",
+    "DELETE FROM block_hashes WHERE file_id=? AND block_index > ?;",
+    "DELETE FROM metadata WHERE path=?;",
+    "SELECT block_index, checksum, algo FROM block_hashes "
+    "WHERE file_id=? AND block_index < ? ORDER BY block_index;",
+    "SELECT checksum, algo FROM merkle_nodes WHERE file_id=? AND level=? AND node_index=?;",
+    "INSERT OR REPLACE INTO merkle_nodes(file_id, level, node_index, checksum, algo) VALUES(?, ?, ?, ?, ?);",
+    "DELETE FROM merkle_nodes WHERE file_id=?;",
+    "SELECT merkle_root, merkle_algo, merkle_blocks FROM files WHERE file_id=?;",
+    "UPDATE files SET merkle_root=?2, merkle_algo=?3, merkle_blocks=?4 WHERE file_id=?1;",
+    "UPDATE files SET merkle_root=NULL, verified_at=NULL WHERE file_id=?;",
+    "SELECT file_id, path FROM files WHERE file_id > ? ORDER BY file_id LIMIT ?;",
+    // Only if no leaf changed since the scrub read the root it checked against
+    "UPDATE files SET verified_at=?2, verified_size=?4, verified_mtime_ns=?5,"
+    " verified_ctime_ns=?6, verified_ino=?7 WHERE file_id=?1 AND merkle_root=?3;",
+    "SELECT verified_at, verified_size, verified_mtime_ns, verified_ctime_ns, verified_ino "
+    "FROM files WHERE file_id=?;",
+    "BEGIN IMMEDIATE;",
+    "COMMIT;",
+    "ROLLBACK;",
+};
+
+static sqlite3_stmt* stmt_cache[STMT_COUNT] = {};
+
+// FUSE dispatches on several threads; a cached statement can only be bound
+// and stepped by one of them at a time.
+static std::mutex db_mutex;
+
+static int prepare_statements() {
+    for (int i = 0; i < STMT_COUNT; ++i) {
+        if (sqlite3_prepare_v3(meta_db, STMT_SQL[i], -1, SQLITE_PREPARE_PERSISTENT,
+                               &stmt_cache[i], nullptr) != SQLITE_OK) {
+            LOGE("prepare failed: " << sqlite3_errmsg(meta_db)
+                 << " (" << STMT_SQL[i] << ")");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void finalize_statements() {
+    for (int i = 0; i < STMT_COUNT; ++i) {
+        sqlite3_finalize(stmt_cache[i]); // NULL-safe
+        stmt_cache[i] = nullptr;
+    }
+}
+
+// Borrow a cached statement. Returns nullptr if the DB never came up.
+static sqlite3_stmt* get_stmt(StmtId id) {
+    return stmt_cache[id];
+}
+
+// Hand a statement back: drop its read lock and bound values for the next user.
+static void put_stmt(sqlite3_stmt* stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+// --- BLOCK HASH CACHE ---
+// Bounded LRU of binary block checksums, keyed by (file_id, block_index).
+// It mirrors block_hashes: the DB helpers below write through on a successful
+// upsert and invalidate on delete or on a failed upsert or commit (all under
+// db_mutex), so a hit is always what SQLite would return. File IDs survive
+// renames, so a rename leaves it untouched.
+// Shards are picked by (file_id, block_index / 16) so readers of one large file
+// spread across locks, while one file's neighbouring blocks share a shard.
+
+static const size_t HASH_CACHE_SHARDS = 16;
+
+// A stored block checksum and the algorithm (ChecksumAlgo id) that produced it.
+struct BlockHash {
+    uint64_t value;
+    int64_t algo;
+};
+
+struct CachedHash {
+    int64_t file_id;
+    int64_t block_idx;
+    BlockHash hash;
+};
+
+struct HashCacheShard {
+    std::mutex mtx;
+    std::list<CachedHash> lru; // front = most recently used
+    std::unordered_map<int64_t,
+        std::unordered_map<int64_t, std::list<CachedHash>::iterator>> files;
+};
+
+static HashCacheShard hash_cache[HASH_CACHE_SHARDS];
+
+static HashCacheShard& cache_shard(int64_t file_id, int64_t block_idx) {
+    size_t h = std::hash<int64_t>()(file_id * 0x9E3779B97F4A7C15ULL) ^ std::hash<int64_t>()(block_idx / 16);
+    return hash_cache[h % HASH_CACHE_SHARDS];
+}
+
+static size_t cache_shard_capacity() {
+    if (block_cache_entries == 0) return 0;
+    return std::max<size_t>(1, block_cache_entries / HASH_CACHE_SHARDS);
+}
+
+static bool cache_get(int64_t file_id, int64_t block_idx, BlockHash& out) {
+    if (block_cache_entries == 0) return false;
+    HashCacheShard& sh = cache_shard(file_id, block_idx);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    auto f = sh.files.find(file_id);
+    if (f == sh.files.end()) return false;
+    auto b = f->second.find(block_idx);
+    if (b == f->second.end()) return false;
+    sh.lru.splice(sh.lru.begin(), sh.lru, b->second);
+    out = b->second->hash;
+    return true;
+}
+
+static void cache_erase_locked(HashCacheShard& sh, std::list<CachedHash>::iterator it) {
+    auto f = sh.files.find(it->file_id);
+    f->second.erase(it->block_idx);
+    if (f->second.empty()) sh.files.erase(f);
+    sh.lru.erase(it);
+}
+
+static void cache_put(int64_t file_id, int64_t block_idx, BlockHash hash) {
+    size_t cap = cache_shard_capacity();
+    if (cap == 0) return;
+    HashCacheShard& sh = cache_shard(file_id, block_idx);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    auto& blocks = sh.files[file_id];
+    auto b = blocks.find(block_idx);
+    if (b != blocks.end()) {
+        b->second->hash = hash;
+        sh.lru.splice(sh.lru.begin(), sh.lru, b->second);
+        return;
+    }
+    sh.lru.push_front({file_id, block_idx, hash});
+    blocks[block_idx] = sh.lru.begin();
+    while (sh.lru.size() > cap) cache_erase_locked(sh, std::prev(sh.lru.end()));
+}
+
+static void cache_erase(int64_t file_id, int64_t block_idx) {
+    if (block_cache_entries == 0) return;
+    HashCacheShard& sh = cache_shard(file_id, block_idx);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    auto f = sh.files.find(file_id);
+    if (f == sh.files.end()) return;
+    auto b = f->second.find(block_idx);
+    if (b != f->second.end()) cache_erase_locked(sh, b->second);
+}
+
+// Forget everything, e.g. after a commit failed and the DB rolled back.
+static void cache_clear() {
+    for (auto& sh : hash_cache) {
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        sh.files.clear();
+        sh.lru.clear();
+    }
+}
+
+// Drop every cached block of `file_id` with block_index > after_idx (-1 = whole file).
+static void cache_invalidate(int64_t file_id, int64_t after_idx = -1) {
+    if (block_cache_entries == 0) return;
+    for (auto& sh : hash_cache) {
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        auto f = sh.files.find(file_id);
+        if (f == sh.files.end()) continue;
+        for (auto b = f->second.begin(); b != f->second.end(); ) {
+            if (b->first > after_idx) {
+                sh.lru.erase(b->second);
+                b = f->second.erase(b);
+            } else {
+                ++b;
+            }
+        }
+        if (f->second.empty()) sh.files.erase(f);
+    }
+}
+
+// --- FILE IDS ---
+// block_hashes rows are keyed by a stable ID from the `files` table rather than
+// by path, so a rename rewrites one `files` row instead of every block row.
+// Resolved IDs are memoized; a memo hit takes only file_id_mutex, so cached
+// reads never wait on db_mutex. Lock order: db_mutex, then file_id_mutex.
+
+static const size_t FILE_ID_MEMO_MAX = 65536;
+static const int64_t NO_FILE_ID = 0; // AUTOINCREMENT ids start at 1
+
+static std::mutex file_id_mutex;
+static std::unordered_map<std::string, int64_t> file_id_memo; // NO_FILE_ID = no row
+
+static bool file_id_memo_get(const std::string& path, int64_t& id) {
+    std::lock_guard<std::mutex> lock(file_id_mutex);
+    auto it = file_id_memo.find(path);
+    if (it == file_id_memo.end()) return false;
+    id = it->second;
+    return true;
+}
+
+static void file_id_memo_put(const std::string& path, int64_t id) {
+    std::lock_guard<std::mutex> lock(file_id_mutex);
+    if (file_id_memo.size() >= FILE_ID_MEMO_MAX) file_id_memo.clear();
+    file_id_memo[path] = id;
+}
+
+static void file_id_memo_erase(const std::string& path) {
+    std::lock_guard<std::mutex> lock(file_id_mutex);
+    file_id_memo.erase(path);
+}
+
+static void file_id_memo_clear() {
+    std::lock_guard<std::mutex> lock(file_id_mutex);
+    file_id_memo.clear();
+}
+
+// Caller holds db_mutex. Returns NO_FILE_ID if `path` has no row (or, with
+// `create`, if one could not be inserted).
+static int64_t lookup_file_id_locked(const char* path, bool create) {
+    int64_t id;
+    if (file_id_memo_get(path, id) && (id != NO_FILE_ID || !create)) return id;
+
+    id = NO_FILE_ID;
+    sqlite3_stmt* stmt = get_stmt(STMT_LOOKUP_FILE_ID);
+    if (!stmt) return NO_FILE_ID;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int64(stmt, 0);
+    put_stmt(stmt);
+
+    if (id == NO_FILE_ID && create) {
+        stmt = get_stmt(STMT_INSERT_FILE);
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_DONE) id = sqlite3_last_insert_rowid(meta_db);
+        put_stmt(stmt);
+    }
+    file_id_memo_put(path, id);
+    return id;
+}
+
+static int64_t lookup_file_id(const char* path) {
+    int64_t id;
+    if (file_id_memo_get(path, id)) return id;
+    std::lock_guard<std::mutex> lock(db_mutex);
+    return lookup_file_id_locked(path, false);
+}
+
 // --- DATABASE HELPERS ---
 
-static std::string get_db_block_hash(const char* path, int64_t block_idx) {
-    std::string res = "";
-    const char* sql = "SELECT checksum FROM block_hashes WHERE path=? AND block_index=?;";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
+// Run a statement parameterized by (file_id[, block_index]).
+static void exec_file_stmt(StmtId id, int64_t file_id, int64_t block_idx = 0) {
+    sqlite3_stmt* stmt = get_stmt(id);
+    if (!stmt) return;
+    sqlite3_bind_int64(stmt, 1, file_id);
+    if (sqlite3_bind_parameter_count(stmt) > 1) sqlite3_bind_int64(stmt, 2, block_idx);
+    sqlite3_step(stmt);
+    put_stmt(stmt);
+}
+
+// Files the scrubber verified end to end, with the fingerprint their backing
+// file had then. With -o scrub_trust=on, fs_read skips per-block verification
+// while the fd still matches it and the check is younger than scrub_interval.
+// Opt-in: bit rot that leaves size, times and inode alone goes unnoticed
+// until the next pass. Loaded from the `files` row on open; writes through
+// the mount drop it in the same step that clears `verified_at`.
+// Lock order: db_mutex, then trust_mutex.
+static bool scrub_trust = false;
+
+struct ScrubTrust {
+    FileFingerprint fp;
+    int64_t verified_at;
+};
+
+static const size_t TRUST_MAX = 65536;
+static std::mutex trust_mutex;
+static std::unordered_map<int64_t, ScrubTrust> trusted_files;
+static std::atomic<size_t> trusted_count{0};  // lets fs_read skip the lock
+
+static bool trust_current(const ScrubTrust& t) {
+    return time(nullptr) - t.verified_at <= (int64_t)scrub_interval;
+}
+
+static void trust_put(int64_t file_id, const ScrubTrust& t) {
+    std::lock_guard<std::mutex> lock(trust_mutex);
+    if (trusted_files.size() >= TRUST_MAX) trusted_files.clear();
+    trusted_files[file_id] = t;
+    trusted_count.store(trusted_files.size(), std::memory_order_release);
+}
+
+static void trust_erase(int64_t file_id) {
+    if (trusted_count.load(std::memory_order_acquire) == 0) return;
+    std::lock_guard<std::mutex> lock(trust_mutex);
+    trusted_files.erase(file_id);
+    trusted_count.store(trusted_files.size(), std::memory_order_release);
+}
+
+// Does the scrub that verified `path` still describe what `fd` reads?
+static bool trust_covers(const char* path, int fd) {
+    if (trusted_count.load(std::memory_order_acquire) == 0) return false;
+    int64_t file_id = lookup_file_id(path);
+    ScrubTrust t;
+    {
+        std::lock_guard<std::mutex> lock(trust_mutex);
+        auto it = trusted_files.find(file_id);
+        if (it == trusted_files.end()) return false;
+        t = it->second;
+    }
+    struct stat st;
+    return trust_current(t) && fstat(fd, &st) == 0 && fingerprint_of(st) == t.fp;
+}
+
+// Which files have a persisted Merkle tree (see MERKLE TREE below). Absent =
+// not looked up yet. Guarded by db_mutex, like the tree rows themselves.
+static const size_t MERKLE_MEMO_MAX = 65536;
+static std::unordered_map<int64_t, bool> merkle_built;
+
+// Caller holds db_mutex. Drop the file's tree before its leaves change, in the
+// same transaction, so a persisted root never describes other block hashes.
+// Costs two statements the first time a file is written after mount, none after.
+static void merkle_invalidate_locked(int64_t file_id) {
+    trust_erase(file_id);
+    auto it = merkle_built.find(file_id);
+    if (it != merkle_built.end() && !it->second) return;
+    exec_file_stmt(STMT_CLEAR_ROOT, file_id);
+    exec_file_stmt(STMT_DELETE_TREE, file_id);
+    if (merkle_built.size() >= MERKLE_MEMO_MAX) merkle_built.clear();
+    merkle_built[file_id] = false;
+}
+
+// Expected hash of one block. Returns false if the block has no stored hash.
+static bool get_block_hash(const char* path, int64_t block_idx, BlockHash& out) {
+    int64_t file_id = lookup_file_id(path);
+    if (file_id == NO_FILE_ID) return false;
+    if (cache_get(file_id, block_idx, out)) return true;
+
+    // Cache fills and invalidations both happen under db_mutex, so a fill can
+    // never resurrect a row that a concurrent delete just removed.
+    bool found = false;
+    std::lock_guard<std::mutex> lock(db_mutex);
+    sqlite3_stmt* stmt = get_stmt(STMT_GET_BLOCK_HASH);
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, file_id);
         sqlite3_bind_int64(stmt, 2, block_idx);
         if (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char* txt = sqlite3_column_text(stmt, 0);
-            if (txt) res = reinterpret_cast<const char*>(txt);
+            if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+                out.value = (uint64_t)sqlite3_column_int64(stmt, 0);
+                out.algo  = sqlite3_column_int64(stmt, 1);
+                found = true;
+            }
         }
-        sqlite3_finalize(stmt);
+        put_stmt(stmt);
     }
-    return res;
+    if (found) cache_put(file_id, block_idx, out);
+    return found;
 }
 
-static void set_db_block_hash(const char* path, int64_t block_idx, std::string hash_str) {
-    const char* sql = "INSERT OR REPLACE INTO block_hashes(path, block_index, checksum) VALUES(?, ?, ?);";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int64(stmt, 2, block_idx);
-        sqlite3_bind_text(stmt, 3, hash_str.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+// Caller holds db_mutex and has invalidated the file's Merkle tree.
+// Hashes are always produced with the mount's checksum_algo.
+static void put_block_hashes_locked(int64_t file_id, int64_t first_block,
+                                    const uint64_t* hashes, size_t count) {
+    sqlite3_stmt* stmt = get_stmt(STMT_SET_BLOCK_HASH);
+    for (size_t i = 0; i < count; ++i) {
+        sqlite3_bind_int64(stmt, 1, file_id);
+        sqlite3_bind_int64(stmt, 2, first_block + i);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)hashes[i]);
+        sqlite3_bind_int64(stmt, 4, checksum_algo);
+        // The cache must never hold a hash the DB did not take
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            cache_put(file_id, first_block + i, {hashes[i], checksum_algo});
+        } else {
+            LOGE("DB ERROR: block hash upsert failed: " << sqlite3_errmsg(meta_db));
+            cache_erase(file_id, first_block + i);
+        }
+        put_stmt(stmt);
     }
 }
 
-static void delete_file_hashes(const char* path) {
-    const char* sql = "DELETE FROM block_hashes WHERE path=?;";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
+// Upsert the hashes of `count` consecutive blocks under one lock acquisition.
+static void set_block_hashes(const char* path, int64_t first_block,
+                             const uint64_t* hashes, size_t count) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    int64_t file_id = lookup_file_id_locked(path, true);
+    if (file_id == NO_FILE_ID) return;
+    merkle_invalidate_locked(file_id);
+    put_block_hashes_locked(file_id, first_block, hashes, count);
+}
+
+static void set_block_hash(const char* path, int64_t block_idx, uint64_t hash) {
+    set_block_hashes(path, block_idx, &hash, 1);
+}
+
+// Does `data` still hash to what was stored? Rows written by an unknown
+// (newer) algorithm cannot be checked and count as mismatches.
+static bool block_matches(const BlockHash& expected, const char* data, size_t len) {
+    ChecksumAlgo algo;
+    if (!checksum_from_id(expected.algo, algo)) return false;
+    return checksum_of(algo, data, len) == expected.value;
+}
+
+// Used for Truncate: one range delete on the (file_id, block_index) key drops
+// every row past `last_block` (-1 = every block). `tail`, if given, is the new
+// hash of `last_block` itself.
+static void truncate_block_hashes(const char* path, int64_t last_block, const uint64_t* tail) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    int64_t file_id = lookup_file_id_locked(path, tail != nullptr);
+    if (file_id == NO_FILE_ID) return;
+    merkle_invalidate_locked(file_id);
+    cache_invalidate(file_id, last_block);
+    exec_file_stmt(STMT_DELETE_HASHES_AFTER, file_id, last_block);
+    if (tail) put_block_hashes_locked(file_id, last_block, tail, 1);
+}
+
+// Caller holds db_mutex. Drop a file's block hashes and its `files` row.
+static void drop_file_locked(int64_t file_id) {
+    cache_invalidate(file_id);
+    exec_file_stmt(STMT_DELETE_TREE, file_id);
+    exec_file_stmt(STMT_DELETE_FILE_HASHES, file_id);
+    exec_file_stmt(STMT_DELETE_FILE, file_id);
+    merkle_built.erase(file_id);
+    trust_erase(file_id);
+}
+
+static void delete_file_entry(const char* path) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    int64_t file_id = lookup_file_id_locked(path, false);
+    if (file_id != NO_FILE_ID) drop_file_locked(file_id);
+    file_id_memo_erase(path);
+}
+
+// One `files` row per renamed file; block rows and cached hashes stay as they are.
+static void rename_file_entry(const char* from, const char* to, bool is_dir) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+
+    // rename() replaced whatever file was at `to`
+    int64_t replaced = lookup_file_id_locked(to, false);
+    if (replaced != NO_FILE_ID) drop_file_locked(replaced);
+
+    int64_t file_id = lookup_file_id_locked(from, false);
+    if (file_id != NO_FILE_ID) {
+        sqlite3_stmt* stmt = get_stmt(STMT_RENAME_FILE);
+        sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, file_id);
         sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+        put_stmt(stmt);
+    }
+
+    if (is_dir) {
+        sqlite3_stmt* stmt = get_stmt(STMT_RENAME_CHILDREN);
+        if (stmt) {
+            sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, from, -1, SQLITE_STATIC);
+            sqlite3_step(stmt);
+            put_stmt(stmt);
+        }
+        file_id_memo_clear(); // every memoized path under `from` is stale
+    } else {
+        file_id_memo_erase(from);
+        file_id_memo_put(to, file_id);
     }
 }
 
-// Used for Truncate: Delete blocks that are cut off
-static void delete_hashes_after_index(const char* path, int64_t start_idx) {
-    const char* sql = "DELETE FROM block_hashes WHERE path=? AND block_index > ?;";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int64(stmt, 2, start_idx);
+static void delete_file_metadata(const char* path) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    sqlite3_stmt* stmt = get_stmt(STMT_DELETE_METADATA);
+    if (stmt) {
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
         sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+        put_stmt(stmt);
+    }
+}
+
+// --- WRITE BATCHING ---
+// Durability contract:
+//  - Block data is always pwrite()n before its hash is upserted.
+//  - All hash upserts of one fs_write share a single SQLite transaction, so a
+//    128 KB FUSE write pays one journal commit instead of 32.
+//  - With commit_window_ms / commit_window_kb set, that transaction stays open
+//    across writes until the window is exceeded. A timer thread commits a
+//    window that outlives commit_window_ms even if no further write arrives.
+//  - fsync, release, truncate, unlink, rename and unmount always commit it, even
+//    while other writes are in flight: those continue in a fresh transaction.
+//  - After a crash, every write covered by a completed fsync() has its hashes
+//    on disk. Blocks written inside a lost window keep their previous hash and
+//    read back as EIO until rewritten; blocks that had no hash read unverified.
+
+static bool batch_open = false;
+static int batch_writers = 0;          // fs_write calls currently inside the batch
+static size_t batch_bytes = 0;
+static std::chrono::steady_clock::time_point batch_started;
+
+// Window timer (commit_window_ms only). Waits on db_mutex like everything above.
+static std::condition_variable batch_cv;
+static std::thread batch_timer;
+static bool batch_timer_quit = false;
+
+static bool exec_stmt(StmtId id) {
+    sqlite3_stmt* stmt = get_stmt(id);
+    if (!stmt) return false;
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    if (!ok) {
+        LOGE("DB ERROR: " << sqlite3_errmsg(meta_db));
+    }
+    put_stmt(stmt);
+    return ok;
+}
+
+// Caller holds db_mutex.
+static void commit_batch_locked() {
+    if (!batch_open) return;
+    if (!exec_stmt(STMT_COMMIT)) {
+        // Upserts of this batch may be lost; cached copies of them must go too
+        if (!sqlite3_get_autocommit(meta_db)) exec_stmt(STMT_ROLLBACK);
+        cache_clear();
+    }
+    batch_open = false;
+    batch_bytes = 0;
+}
+
+static bool batch_window_expired() {
+    if (commit_window_ms == 0 && commit_window_kb == 0) return true;
+    if (commit_window_kb && batch_bytes >= commit_window_kb * 1024) return true;
+    if (commit_window_ms) {
+        auto age = std::chrono::steady_clock::now() - batch_started;
+        if (age >= std::chrono::milliseconds(commit_window_ms)) return true;
+    }
+    return false;
+}
+
+// Caller holds db_mutex. If BEGIN fails, no batch is open and every upsert
+// commits on its own until the next attempt.
+static void open_batch_locked() {
+    if (batch_open) return;
+    if (!exec_stmt(STMT_BEGIN)) {
+        LOGE("DB ERROR: cannot open a write batch; hashes are committed one by one");
+        return;
+    }
+    batch_open = true;
+    batch_started = std::chrono::steady_clock::now();
+    batch_cv.notify_one();
+}
+
+// Caller holds db_mutex. Commit now; writes still in flight get a new transaction.
+static void commit_now_locked() {
+    commit_batch_locked();
+    if (batch_writers > 0) open_batch_locked();
+}
+
+static void begin_write_batch() {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    open_batch_locked();
+    batch_writers++;
+}
+
+static void end_write_batch(size_t bytes) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    batch_writers--;
+    batch_bytes += bytes;
+    if (batch_writers == 0 && batch_window_expired()) commit_batch_locked();
+}
+
+// Commit any pending window (fsync/release/namespace changes/unmount).
+static void flush_write_batch() {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    commit_now_locked();
+}
+
+static void batch_timer_main() {
+    std::unique_lock<std::mutex> lock(db_mutex);
+    while (!batch_timer_quit) {
+        if (!batch_open) {
+            batch_cv.wait(lock);
+            continue;
+        }
+        auto deadline = batch_started + std::chrono::milliseconds(commit_window_ms);
+        if (std::chrono::steady_clock::now() >= deadline) {
+            commit_now_locked();
+        } else {
+            batch_cv.wait_until(lock, deadline);
+        }
+    }
+}
+
+// Start the window timer. Call from the FUSE init hook, after the DB is up.
+static void batch_timer_start() {
+    if (commit_window_ms == 0) return;
+    batch_timer_quit = false;
+    batch_timer = std::thread(batch_timer_main);
+}
+
+// Call from the FUSE destroy hook, before the final flush.
+static void batch_timer_stop() {
+    if (!batch_timer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(db_mutex);
+        batch_timer_quit = true;
+    }
+    batch_cv.notify_one();
+    batch_timer.join();
+}
+
+// --- MERKLE TREE ---
+// A tree over each file's block hashes, so a whole file has one root.
+//  - Leaves are the block_hashes rows. Interior nodes live in merkle_nodes
+//    (level 1 = parents of leaves), and the root plus the block count it covers
+//    live in the file's `files` row.
+//  - Each node hashes its children's (checksum, algo) entries with the mount's
+//    algorithm, and the root also covers the block count. A file with any
+//    block lacking a stored hash has no root: it would say nothing about that
+//    block's content, so two such files could share a root but not their data.
+//  - The tree is built lazily, from one ordered scan of the leaf rows, when
+//    the root is asked for. Any leaf change drops it (merkle_invalidate_locked).
+//    Writes therefore pay nothing beyond the first drop, and reads of files
+//    that are not changing get to use it.
+//  - A read covering a whole aligned level-1 group is checked against that one
+//    node instead of MERKLE_FANOUT leaves.
+
+static const size_t MERKLE_FANOUT = 32;   // 32 blocks = 128 KiB, the kernel's usual read size
+static const char* const MERKLE_XATTR = "user.blockfs.merkle_root";
+
+static void merkle_put_u64(std::string& buf, uint64_t v) {
+    char b[8];
+    for (int i = 0; i < 8; ++i) b[i] = (char)(v >> (8 * i));
+    buf.append(b, 8);
+}
+
+static void merkle_put_child(std::string& buf, uint64_t value, uint8_t tag) {
+    merkle_put_u64(buf, value);
+    buf.push_back((char)tag);
+}
+
+// Level-1 node over consecutive full blocks in `data`, hashed with the mount's algorithm
+static uint64_t merkle_group_of_data(const char* data, size_t nblocks) {
+    std::string buf;
+    buf.reserve(nblocks * 9);
+    for (size_t i = 0; i < nblocks; ++i) {
+        merkle_put_child(buf, checksum_of(checksum_algo, data + i * BLOCK_SIZE, BLOCK_SIZE),
+                         (uint8_t)checksum_algo);
+    }
+    return checksum_of(checksum_algo, buf.data(), buf.size());
+}
+
+// Caller holds db_mutex. levels[0] is level 1; levels.back() holds the single top node.
+// Empty for a file with no blocks. Returns false if any block has no stored hash.
+static bool merkle_build_locked(int64_t file_id, uint64_t nblocks,
+                                std::vector<std::vector<uint64_t>>& levels) {
+    levels.clear();
+    if (nblocks == 0) return true;
+    if (file_id == NO_FILE_ID) return false;
+    levels.emplace_back((nblocks + MERKLE_FANOUT - 1) / MERKLE_FANOUT);
+
+    // Level 1 straight from the ordered leaf scan; leaves are never held all at once
+    sqlite3_stmt* stmt = get_stmt(STMT_GET_LEAVES);
+    if (!stmt) return false;
+    sqlite3_bind_int64(stmt, 1, file_id);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)nblocks);
+    bool have_row = sqlite3_step(stmt) == SQLITE_ROW;
+    std::string buf;
+    for (size_t g = 0; g < levels[0].size(); ++g) {
+        buf.clear();
+        uint64_t end = std::min<uint64_t>(nblocks, (g + 1) * MERKLE_FANOUT);
+        for (uint64_t b = g * MERKLE_FANOUT; b < end; ++b) {
+            // Rows come in block order, one per block at most
+            if (!have_row || (uint64_t)sqlite3_column_int64(stmt, 0) != b ||
+                sqlite3_column_type(stmt, 1) == SQLITE_NULL) {
+                put_stmt(stmt);
+                return false;
+            }
+            merkle_put_child(buf, (uint64_t)sqlite3_column_int64(stmt, 1),
+                             (uint8_t)sqlite3_column_int64(stmt, 2));
+            have_row = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+        levels[0][g] = checksum_of(checksum_algo, buf.data(), buf.size());
+    }
+    put_stmt(stmt);
+
+    while (levels.back().size() > 1) {
+        const std::vector<uint64_t>& below = levels.back();
+        std::vector<uint64_t> up((below.size() + MERKLE_FANOUT - 1) / MERKLE_FANOUT);
+        for (size_t n = 0; n < up.size(); ++n) {
+            buf.clear();
+            size_t end = std::min(below.size(), (n + 1) * MERKLE_FANOUT);
+            for (size_t c = n * MERKLE_FANOUT; c < end; ++c) {
+                merkle_put_child(buf, below[c], (uint8_t)checksum_algo);
+            }
+            up[n] = checksum_of(checksum_algo, buf.data(), buf.size());
+        }
+        levels.push_back(std::move(up));
+    }
+    return true;
+}
+
+static uint64_t merkle_root_of(uint64_t nblocks, const std::vector<std::vector<uint64_t>>& levels) {
+    std::string buf;
+    merkle_put_u64(buf, nblocks);
+    if (!levels.empty()) merkle_put_child(buf, levels.back()[0], (uint8_t)checksum_algo);
+    return checksum_of(checksum_algo, buf.data(), buf.size());
+}
+
+// Caller holds db_mutex. Store a freshly built tree in the write batch, under the
+// same window and commit rules as block hashes.
+static void merkle_persist_locked(int64_t file_id, uint64_t nblocks, uint64_t root,
+                                  const std::vector<std::vector<uint64_t>>& levels) {
+    open_batch_locked();
+    exec_file_stmt(STMT_DELETE_TREE, file_id);
+    sqlite3_stmt* stmt = get_stmt(STMT_SET_TREE_NODE);
+    for (size_t l = 0; l < levels.size(); ++l) {
+        for (size_t n = 0; n < levels[l].size(); ++n) {
+            sqlite3_bind_int64(stmt, 1, file_id);
+            sqlite3_bind_int64(stmt, 2, (sqlite3_int64)(l + 1));
+            sqlite3_bind_int64(stmt, 3, (sqlite3_int64)n);
+            sqlite3_bind_int64(stmt, 4, (sqlite3_int64)levels[l][n]);
+            sqlite3_bind_int64(stmt, 5, checksum_algo);
+            sqlite3_step(stmt);
+            put_stmt(stmt);
+        }
+    }
+    stmt = get_stmt(STMT_SET_ROOT);
+    sqlite3_bind_int64(stmt, 1, file_id);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)root);
+    sqlite3_bind_int64(stmt, 3, checksum_algo);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)nblocks);
+    sqlite3_step(stmt);
+    put_stmt(stmt);
+    if (batch_writers == 0 && batch_window_expired()) commit_batch_locked();
+
+    if (merkle_built.size() >= MERKLE_MEMO_MAX) merkle_built.clear();
+    merkle_built[file_id] = true;
+}
+
+// Root over the stored hashes of the file's first `nblocks` blocks. Served
+// from the `files` row while the persisted tree is current, rebuilt otherwise.
+// Returns false if the file has no root: some block has no stored hash.
+static bool merkle_root(const char* path, uint64_t nblocks, uint64_t& root) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    int64_t file_id = lookup_file_id_locked(path, false);
+    if (file_id != NO_FILE_ID) {
+        sqlite3_stmt* stmt = get_stmt(STMT_GET_ROOT);
+        bool current = false;
+        if (stmt) {
+            sqlite3_bind_int64(stmt, 1, file_id);
+            if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+                root = (uint64_t)sqlite3_column_int64(stmt, 0);
+                current = sqlite3_column_int64(stmt, 1) == checksum_algo &&
+                          (uint64_t)sqlite3_column_int64(stmt, 2) == nblocks;
+            }
+            put_stmt(stmt);
+        }
+        if (current) return true;
+    }
+
+    std::vector<std::vector<uint64_t>> levels;
+    if (!merkle_build_locked(file_id, nblocks, levels)) return false;
+    root = merkle_root_of(nblocks, levels);
+    if (file_id != NO_FILE_ID && get_stmt(STMT_SET_ROOT)) {
+        merkle_persist_locked(file_id, nblocks, root, levels);
+        LOGD("merkle_root: built tree for " << path << " (" << nblocks << " blocks)");
+    }
+    return true;
+}
+
+// Caller holds db_mutex.
+static bool merkle_has_tree_locked(int64_t file_id) {
+    auto it = merkle_built.find(file_id);
+    if (it != merkle_built.end()) return it->second;
+    bool has = false;
+    if (sqlite3_stmt* stmt = get_stmt(STMT_GET_ROOT)) {
+        sqlite3_bind_int64(stmt, 1, file_id);
+        has = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL;
+        put_stmt(stmt);
+    }
+    if (merkle_built.size() >= MERKLE_MEMO_MAX) merkle_built.clear();
+    merkle_built[file_id] = has;
+    return has;
+}
+
+// Do MERKLE_FANOUT full blocks of `data`, starting at block group*MERKLE_FANOUT,
+// match the stored level-1 node? false also when there is no usable node; the
+// caller then checks the blocks one by one.
+static bool merkle_group_matches(const char* path, int64_t group, const char* data) {
+    int64_t file_id = lookup_file_id(path);
+    if (file_id == NO_FILE_ID) return false;
+
+    uint64_t node = 0;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(db_mutex);
+        if (!merkle_has_tree_locked(file_id)) return false;
+        sqlite3_stmt* stmt = get_stmt(STMT_GET_TREE_NODE);
+        if (!stmt) return false;
+        sqlite3_bind_int64(stmt, 1, file_id);
+        sqlite3_bind_int64(stmt, 2, 1);
+        sqlite3_bind_int64(stmt, 3, group);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 1) == checksum_algo) {
+            node = (uint64_t)sqlite3_column_int64(stmt, 0);
+            found = true;
+        }
+        put_stmt(stmt);
+    }
+    return found && merkle_group_of_data(data, MERKLE_FANOUT) == node;
+}
+
+// --- BACKGROUND SCRUB ---
+// With -o scrub=on, a thread reads every file that has a `files` row through
+// the scrub.h budget and checks it the way fs_read would: whole 128 KiB groups
+// against their level-1 node, everything else block by block. A clean file
+// gets verified_at, tied to the root it was checked against, so the next leaf
+// change clears it.
+// A block that fails is looked at again after SCRUB_RECHECK_MS, since a write
+// updates its hash just after its data. If it still fails and the file has not
+// been written to meanwhile, the file and its rows move to QUARANTINE_DIR.
+// Handles still open on the old path get EIO from then on: blockfs handles are
+// plain fds, so the old path is remembered until something new is created there.
+
+static const int SCRUB_PAGE = 64;
+static const int SCRUB_RECHECK_MS = 200;
+static_assert(SCRUB_READ_SIZE == MERKLE_FANOUT * BLOCK_SIZE, "a scrub read is one level-1 group");
+
+static std::mutex quarantined_mutex;
+static std::unordered_set<std::string> quarantined_paths;
+static std::atomic<size_t> quarantined_count{0};  // lets fs_read skip the lock
+
+static bool is_quarantined(const char* path) {
+    if (quarantined_count.load(std::memory_order_acquire) == 0) return false;
+    std::lock_guard<std::mutex> lock(quarantined_mutex);
+    return quarantined_paths.count(path) != 0;
+}
+
+static void set_quarantined(const char* path, bool on) {
+    std::lock_guard<std::mutex> lock(quarantined_mutex);
+    if (on) quarantined_paths.insert(path);
+    else quarantined_paths.erase(path);
+    quarantined_count.store(quarantined_paths.size(), std::memory_order_release);
+}
+
+// First block of `data` (blocks from `first_block`, `len` bytes) that fails its
+// stored hash, or -1.
+static int64_t scrub_first_bad_block(const char* path, int64_t first_block,
+                                     const char* data, size_t len) {
+    if (len == MERKLE_FANOUT * BLOCK_SIZE && first_block % MERKLE_FANOUT == 0 &&
+        merkle_group_matches(path, first_block / MERKLE_FANOUT, data)) {
+        return -1;
+    }
+    for (size_t off = 0; off < len; off += BLOCK_SIZE) {
+        BlockHash expected;
+        int64_t block_idx = first_block + off / BLOCK_SIZE;
+        if (get_block_hash(path, block_idx, expected) &&
+            !block_matches(expected, data + off, std::min(BLOCK_SIZE, len - off))) {
+            return block_idx;
+        }
+    }
+    return -1;
+}
+
+static void scrub_quarantine(const char* path, int64_t block_idx) {
+    std::string moved = quarantine_move(path);
+    if (moved.empty()) return;
+    set_quarantined(path, true);
+    rename_file_entry(path, moved.c_str(), false);  // block hashes follow the file
+    {
+        std::lock_guard<std::mutex> lock(db_mutex);
+        quarantine_record(meta_db, path, moved,
+                          "block " + std::to_string(block_idx) + " checksum mismatch");
+    }
+    flush_write_batch();
+    LOGE("scrub: quarantined " << path << " as " << moved);
+
+    kernel_invalidate(path);
+    kernel_invalidate(QUARANTINE_DIR);
+}
+
+static void scrub_file(int64_t file_id, const std::string& path, ScrubThrottle& throttle) {
+    AtPath at;
+    if (at_path(path.c_str(), at) != 0) return;
+    int fd = openat(at.fd(), at.name, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) return;  // gone, or a directory's row; unlink/rename own it
+
+    struct stat before;
+    if (fstat(fd, &before) == -1 || !S_ISREG(before.st_mode)) {
+        close(fd);
+        return;
+    }
+    uint64_t nblocks = ((uint64_t)before.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t root = 0;
+    bool have_root = merkle_root(path.c_str(), nblocks, root);  // builds the level-1 nodes
+
+    int64_t next_block = 0, bad = -1;
+    int rc = scrub_read_file(fd, throttle, [&](const char* data, size_t len) {
+        if (bad < 0) bad = scrub_first_bad_block(path.c_str(), next_block, data, len);
+        next_block += MERKLE_FANOUT;
+    });
+    if (rc != 0) {
+        close(fd);
+        return;
+    }
+
+    if (bad < 0) {
+        // Blocks without a hash were not checked, and bytes that changed
+        // mid-pass were not all seen: neither vouches for the file.
+        struct stat after;
+        bool unchanged = fstat(fd, &after) == 0 && fingerprint_of(after) == fingerprint_of(before);
+        close(fd);
+        if (!have_root || !unchanged) return;
+        ScrubTrust trust{fingerprint_of(before), (int64_t)time(nullptr)};
+        std::lock_guard<std::mutex> lock(db_mutex);
+        if (sqlite3_stmt* stmt = get_stmt(STMT_SET_VERIFIED)) {
+            sqlite3_bind_int64(stmt, 1, file_id);
+            sqlite3_bind_int64(stmt, 2, trust.verified_at);
+            sqlite3_bind_int64(stmt, 3, (sqlite3_int64)root);
+            sqlite3_bind_int64(stmt, 4, trust.fp.size);
+            sqlite3_bind_int64(stmt, 5, trust.fp.mtime_ns);
+            sqlite3_bind_int64(stmt, 6, trust.fp.ctime_ns);
+            sqlite3_bind_int64(stmt, 7, trust.fp.ino);
+            // No row changed: a write replaced the root since it was read
+            if (sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(meta_db) > 0 && scrub_trust) {
+                trust_put(file_id, trust);
+            }
+            put_stmt(stmt);
+        }
+        return;
+    }
+
+    // Give an in-flight write time to store its hash, then look again
+    bool confirmed = false;
+    struct stat after;
+    if (scrub_sleep_until(std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(SCRUB_RECHECK_MS)) &&
+        fstat(fd, &after) == 0 && after.st_size == before.st_size &&
+        after.st_mtim.tv_sec == before.st_mtim.tv_sec &&
+        after.st_mtim.tv_nsec == before.st_mtim.tv_nsec) {
+        char block[BLOCK_SIZE];
+        ssize_t got = pread_full(fd, block, BLOCK_SIZE, bad * BLOCK_SIZE);
+        BlockHash expected;
+        confirmed = got > 0 && get_block_hash(path.c_str(), bad, expected) &&
+                    !block_matches(expected, block, got);
+    }
+    close(fd);
+    if (!confirmed) {
+        LOGD("scrub: " << path << " changed while it was checked; skipped");
+        return;
+    }
+
+    LOGE("scrub: INTEGRITY ERROR: Block " << bad << " corrupted in " << path);
+    scrub_quarantine(path.c_str(), bad);
+}
+
+// Pick up a scrub from an earlier mount: the `files` row keeps what trust_put
+// would have held. Only read-only opens are worth it, and only while the
+// scrubber runs, since nothing else renews `verified_at`.
+static void trust_load(const char* path) {
+    int64_t file_id = lookup_file_id(path);
+    if (file_id == NO_FILE_ID) return;
+    {
+        std::lock_guard<std::mutex> lock(trust_mutex);
+        if (trusted_files.count(file_id)) return;
+    }
+    std::lock_guard<std::mutex> lock(db_mutex);
+    sqlite3_stmt* stmt = get_stmt(STMT_GET_VERIFIED);
+    if (!stmt) return;
+    sqlite3_bind_int64(stmt, 1, file_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL &&
+        sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+        ScrubTrust t{{sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2),
+                      sqlite3_column_int64(stmt, 3), sqlite3_column_int64(stmt, 4)},
+                     sqlite3_column_int64(stmt, 0)};
+        if (trust_current(t)) trust_put(file_id, t);
+    }
+    put_stmt(stmt);
+}
+
+static void scrub_pass() {
+    LOGI("scrub: pass started");
+    ScrubThrottle throttle;
+    std::vector<std::pair<int64_t, std::string>> page;
+    int64_t after = 0;
+    size_t files = 0;
+    while (!scrub_stopping()) {
+        page.clear();
+        {
+            std::lock_guard<std::mutex> lock(db_mutex);
+            sqlite3_stmt* stmt = get_stmt(STMT_SCRUB_FILES);
+            if (!stmt) break;
+            sqlite3_bind_int64(stmt, 1, after);
+            sqlite3_bind_int(stmt, 2, SCRUB_PAGE);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                page.emplace_back(sqlite3_column_int64(stmt, 0),
+                                  reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)));
+            }
+            put_stmt(stmt);
+        }
+        if (page.empty()) break;
+        for (const auto& f : page) {
+            if (scrub_stopping()) break;
+            if (is_quarantine_path(f.second)) continue;
+            scrub_file(f.first, f.second, throttle);
+            ++files;
+        }
+        after = page.back().first;
+    }
+    LOGI("scrub: pass " << (scrub_stopping() ? "interrupted" : "finished")
+         << " after " << files << " files");
+}
+
+// --- PARALLEL HASHING ---
+// The full blocks of a large write are independent, so their hashes are
+// computed on a small persistent pool. The FUSE thread queues the run in
+// slices, writes the data while the workers hash, takes slices itself once the
+// write is done, and waits for the rest before the hashes go into the batch.
+// Runs too short to be worth a handoff are hashed inline.
+
+static const size_t HASH_SLICE_BLOCKS = 8;                        // 32 KiB per task
+static const size_t HASH_PARALLEL_MIN_BLOCKS = 2 * HASH_SLICE_BLOCKS;
+static const unsigned HASH_THREADS_MAX = 8;
+
+// The hashes of one write's full blocks. Lives on the writer's stack.
+struct HashRun {
+    const char* data = nullptr;
+    uint64_t* out = nullptr;
+    size_t nblocks = 0;
+    bool queued = false;
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t pending = 0;  // queued slices not finished yet
+};
+
+struct HashTask {
+    HashRun* run;
+    size_t first;  // block within the run
+    size_t count;
+};
+
+struct HashPool {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<HashTask> tasks;
+    std::vector<std::thread> workers;
+    bool stop = false;
+};
+
+static HashPool hash_pool;
+
+static void hash_slice(const HashRun& run, size_t first, size_t count) {
+    for (size_t i = first; i < first + count; ++i) {
+        run.out[i] = checksum_of(checksum_algo, run.data + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+}
+
+static void hash_task_run(const HashTask& t) {
+    hash_slice(*t.run, t.first, t.count);
+    // The owner may return as soon as pending reaches 0; don't touch the run after.
+    std::lock_guard<std::mutex> lock(t.run->mtx);
+    if (--t.run->pending == 0) t.run->cv.notify_all();
+}
+
+static void hash_worker_main() {
+    std::unique_lock<std::mutex> lock(hash_pool.mtx);
+    for (;;) {
+        hash_pool.cv.wait(lock, [] { return !hash_pool.tasks.empty() || hash_pool.stop; });
+        if (hash_pool.tasks.empty()) return;  // stopping
+        HashTask t = hash_pool.tasks.front();
+        hash_pool.tasks.pop_front();
+        lock.unlock();
+        hash_task_run(t);
+        lock.lock();
+    }
+}
+
+// Hash the `nblocks` full blocks at `data` into `out`. Large runs are handed to
+// the pool and finish in hash_blocks_join(); small ones are hashed there inline.
+static void hash_blocks_async(HashRun& run, const char* data, size_t nblocks, uint64_t* out) {
+    run.data = data;
+    run.out = out;
+    run.nblocks = nblocks;
+    if (hash_pool.workers.empty() || nblocks < HASH_PARALLEL_MIN_BLOCKS) return;
+
+    size_t slices = (nblocks + HASH_SLICE_BLOCKS - 1) / HASH_SLICE_BLOCKS;
+    run.pending = slices;
+    run.queued = true;
+    {
+        std::lock_guard<std::mutex> lock(hash_pool.mtx);
+        for (size_t i = 0; i < slices; ++i) {
+            size_t first = i * HASH_SLICE_BLOCKS;
+            hash_pool.tasks.push_back({&run, first, std::min(HASH_SLICE_BLOCKS, nblocks - first)});
+        }
+    }
+    hash_pool.cv.notify_all();
+}
+
+// Wait until every hash of `run` is in `out`. The caller works through queued
+// slices (its own or another writer's) rather than sleeping while any are left.
+static void hash_blocks_join(HashRun& run) {
+    if (!run.queued) {
+        hash_slice(run, 0, run.nblocks);
+        return;
+    }
+    for (;;) {
+        HashTask t;
+        {
+            std::lock_guard<std::mutex> lock(hash_pool.mtx);
+            if (hash_pool.tasks.empty()) break;
+            t = hash_pool.tasks.front();
+            hash_pool.tasks.pop_front();
+        }
+        hash_task_run(t);
+    }
+    std::unique_lock<std::mutex> lock(run.mtx);
+    run.cv.wait(lock, [&run] { return run.pending == 0; });
+}
+
+// Start the workers. Call from the FUSE init hook.
+static void hash_pool_start() {
+    unsigned n = hash_threads;
+    if (n == 0) n = std::min(std::max(std::thread::hardware_concurrency(), 1u), HASH_THREADS_MAX);
+    // The writing thread hashes too, so it counts as one of them
+    hash_pool.stop = false;
+    for (unsigned i = 1; i < n; ++i) hash_pool.workers.emplace_back(hash_worker_main);
+    LOGI("Block hashing: " << n << " thread(s) per large write");
+}
+
+// Call from the FUSE destroy hook, once no write can be in flight.
+static void hash_pool_stop() {
+    {
+        std::lock_guard<std::mutex> lock(hash_pool.mtx);
+        hash_pool.stop = true;
     }
+    hash_pool.cv.notify_all();
+    for (auto& w : hash_pool.workers) w.join();
+    hash_pool.workers.clear();
 }
 
 // --- FUSE IMPLEMENTATION ---
 
-static int fs_getattr(const char* path, struct stat* st) {
+static int fs_getattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
     memset(st, 0, sizeof(struct stat));
-    std::string real = full_path(path);
-    if (lstat(real.c_str(), st) == -1) return -errno;
+    if (fi && fi->fh) {
+        if (fstat((int)fi->fh, st) == -1) return -errno;
+        return 0;
+    }
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (fstatat(at.fd(), at.name, st, AT_SYMLINK_NOFOLLOW) == -1) return -errno;
     return 0;
 }
 
 static int fs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
-                      off_t offset, struct fuse_file_info* fi) {
+                      off_t offset, struct fuse_file_info* fi,
+                      enum fuse_readdir_flags flags) {
     (void) offset; (void) fi;
-    std::string real = full_path(path);
-    DIR* dp = opendir(real.c_str());
-    if (dp == nullptr) return -errno;
-    filler(buf, ".",  nullptr, 0);
-    filler(buf, "..", nullptr, 0);
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    int dfd = openat(at.fd(), at.name, O_RDONLY | O_DIRECTORY);
+    if (dfd == -1) return -errno;
+    DIR* dp = fdopendir(dfd);
+    if (dp == nullptr) { int err = errno; close(dfd); return -err; }
+    filler(buf, ".",  nullptr, 0, (fuse_fill_dir_flags)0);
+    filler(buf, "..", nullptr, 0, (fuse_fill_dir_flags)0);
+    bool plus = flags & FUSE_READDIR_PLUS; // readdirplus: attributes ride along with names
     struct dirent* de;
     while ((de = readdir(dp)) != nullptr) {
         if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-        if (filler(buf, de->d_name, nullptr, 0) != 0) { closedir(dp); return -ENOMEM; }
+        struct stat st;
+        bool have_st = plus && fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+        if (filler(buf, de->d_name, have_st ? &st : nullptr, 0,
+                   have_st ? FUSE_FILL_DIR_PLUS : (fuse_fill_dir_flags)0) != 0) {
+            closedir(dp);
+            return -ENOMEM;
+        }
     }
     closedir(dp);
     return 0;
@@ -131,28 +1303,40 @@ static int fs_open(const char* path, struct fuse_file_info* fi) {
     // SECURITY: WORM Check
     // (You can copy your is_append_only_path logic here if needed)
     
-    std::string real = full_path(path);
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
     
     // <--- FIX START --->
     // We need to READ blocks to verify them before WRITING.
     // So even if the user asks for O_WRONLY, we force O_RDWR internally.
-    int flags = fi->flags;
+    int flags = backing_open_flags(fi->flags);
     if ((flags & O_ACCMODE) == O_WRONLY) {
         flags &= ~O_ACCMODE; // Clear the mode bits
         flags |= O_RDWR;     // Set to Read-Write
     }
     // <--- FIX END --->
 
-    int fd = open(real.c_str(), flags);
+    int fd = openat(at.fd(), at.name, flags);
     if (fd == -1) return -errno;
     fi->fh = fd;
+    if (scrub_trust && scrub_enabled && (flags & O_ACCMODE) == O_RDONLY) trust_load(path);
     
     return 0;
 }
 
 static int fs_release(const char* path, struct fuse_file_info* fi) {
     close((int)fi->fh);
-    // NOTE: No database commit here. Writes are committed instantly.
+    // Last chance to commit hashes still sitting in the write window.
+    flush_write_batch();
+    return 0;
+}
+
+static int fs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+    // Hashes first: once fsync returns, data and its hashes are both durable.
+    flush_write_batch();
+    int fd = (int)fi->fh;
+    int res = datasync ? fdatasync(fd) : fsync(fd);
+    if (res == -1) return -errno;
     return 0;
 }
 
@@ -160,240 +1344,380 @@ static int fs_release(const char* path, struct fuse_file_info* fi) {
 static int fs_read(const char* path, char* buf, size_t size,
                    off_t offset, struct fuse_file_info* fi) {
     int fd = (int)fi->fh;
-    
-    // 1. Perform the actual read from disk
-    ssize_t res = pread(fd, buf, size, offset);
-    if (res == -1) return -errno;
-    if (res == 0) return 0; // EOF
+    if (size == 0) return 0;
+    if (is_quarantined(path)) return -EIO;  // the fd now refers to a quarantined file
+
+    // 1. One block-aligned read covering every block this request touches.
+    // The same bytes are hashed and handed to the caller, so nothing is read twice.
+    int64_t first_block = get_block_index(offset);
+    int64_t last_block  = get_block_index(offset + size - 1);
+    off_t aligned_start = first_block * BLOCK_SIZE;
+    size_t aligned_len  = (last_block - first_block + 1) * BLOCK_SIZE;
+
+    static thread_local std::vector<char> scratch;
+    if (scratch.size() < aligned_len) scratch.resize(aligned_len);
+
+    ssize_t got = pread_full(fd, scratch.data(), aligned_len, aligned_start);
+    if (got == -1) return -errno;
+
+    size_t head = offset - aligned_start;
+    if ((size_t)got <= head) return 0; // EOF
 
     // 2. Verify Blocks
-    // We iterate through every 4KB block touched by this read
-    off_t current_offset = offset;
-    size_t remaining = res;
+    // Each block is hashed over the bytes it actually has (the last one may be short).
+    // A file the scrubber verified, unchanged since, was already hashed whole.
+    bool trusted = trust_covers(path, fd);
+    for (int64_t block_idx = first_block; !trusted && block_idx <= last_block; ++block_idx) {
+        size_t block_off = (block_idx - first_block) * BLOCK_SIZE;
+        if (block_off >= (size_t)got) break;
+        size_t block_len = std::min(BLOCK_SIZE, (size_t)got - block_off);
+
+        // A whole aligned group checks against one tree node
+        if (block_idx % MERKLE_FANOUT == 0 &&
+            block_off + MERKLE_FANOUT * BLOCK_SIZE <= (size_t)got &&
+            merkle_group_matches(path, block_idx / MERKLE_FANOUT, scratch.data() + block_off)) {
+            block_idx += MERKLE_FANOUT - 1;
+            continue;
+        }
 
-    while (remaining > 0) {
-        int64_t block_idx = get_block_index(current_offset);
-        off_t block_start = block_idx * BLOCK_SIZE;
-        
         // Fetch what the DB expects
-        std::string expected_hash = get_db_block_hash(path, block_idx);
-
-        if (!expected_hash.empty()) {
-            // Read the FULL block from disk for verification
-            char block_buf[BLOCK_SIZE];
-            memset(block_buf, 0, BLOCK_SIZE);
-            ssize_t b_read = pread(fd, block_buf, BLOCK_SIZE, block_start);
-            
-            if (b_read > 0) {
-                uint64_t calcd = FNV_OFFSET_BASIS;
-                update_fnv1a(calcd, block_buf, b_read);
-                
-                std::ostringstream oss; oss << std::hex << calcd;
-                
-                if (oss.str() != expected_hash) {
-                    std::cerr << "INTEGRITY ERROR: Block " << block_idx 
-                              << " corrupted in " << path << std::endl;
-                    return -EIO; // Block the read
-                }
+        BlockHash expected_hash;
+        if (get_block_hash(path, block_idx, expected_hash)) {
+            if (!block_matches(expected_hash, scratch.data() + block_off, block_len)) {
+                LOGE("INTEGRITY ERROR: Block " << block_idx 
+                     << " corrupted in " << path);
+                return -EIO; // Block the read
             }
         }
-
-        // Advance to next block boundary
-        size_t offset_in_block = current_offset % BLOCK_SIZE;
-        size_t advance = BLOCK_SIZE - offset_in_block;
-        if (advance > remaining) advance = remaining;
-        
-        current_offset += advance;
-        remaining -= advance;
     }
 
+    // 3. Hand back only the requested slice
+    size_t res = std::min(size, (size_t)got - head);
+    memcpy(buf, scratch.data() + head, res);
     return res;
 }
 
 // --- THE CORE: BLOCK-LEVEL WRITE ---
-static int fs_write(const char* path, const char* buf, size_t size,
-                    off_t offset, struct fuse_file_info* fi) {
-    int fd = (int)fi->fh;
-    size_t written_so_far = 0;
-    
-    while (written_so_far < size) {
-        // 1. Calculate Block Geometry
-        off_t current_offset = offset + written_so_far;
-        int64_t block_idx = get_block_index(current_offset);
-        off_t block_start = block_idx * BLOCK_SIZE;
-        off_t offset_in_block = current_offset % BLOCK_SIZE;
-        
-        // Calculate how much we are writing into THIS block
-        size_t bytes_to_write_here = std::min(size - written_so_far, BLOCK_SIZE - offset_in_block);
 
-        // 2. Read-Verify-Modify-Write Cycle
-        
-        // A. Read the current block from disk
-        char block_buf[BLOCK_SIZE];
-        memset(block_buf, 0, BLOCK_SIZE);
-        ssize_t existing_len = pread(fd, block_buf, BLOCK_SIZE, block_start);
-        if (existing_len == -1) existing_len = 0; // New block or error
-
-        // B. Verify Integrity BEFORE modification (Strict Consistency)
-        if (existing_len > 0) {
-            uint64_t current_hash = FNV_OFFSET_BASIS;
-            update_fnv1a(current_hash, block_buf, existing_len);
-            
-            std::ostringstream oss; oss << std::hex << current_hash;
-            std::string disk_hash = oss.str();
-            std::string db_hash = get_db_block_hash(path, block_idx);
-            
-            if (!db_hash.empty() && db_hash != disk_hash) {
-                std::cerr << "WRITE BLOCKED: Pre-write verification failed for Block " 
-                          << block_idx << std::endl;
-                return -EIO;
-            }
+// Slow path for a block the write only partially covers.
+// Returns bytes written into the block, or -errno.
+static int write_partial_block(const char* path, int fd, const char* data,
+                               size_t len, off_t offset) {
+    // 1. Calculate Block Geometry
+    int64_t block_idx = get_block_index(offset);
+    off_t block_start = block_idx * BLOCK_SIZE;
+    off_t offset_in_block = offset % BLOCK_SIZE;
+
+    // 2. Read-Verify-Modify-Write Cycle
+
+    // A. Read the current block from disk
+    char block_buf[BLOCK_SIZE];
+    memset(block_buf, 0, BLOCK_SIZE);
+    ssize_t existing_len = pread_full(fd, block_buf, BLOCK_SIZE, block_start);
+    if (existing_len == -1) existing_len = 0; // New block or error
+
+    // B. Verify Integrity BEFORE modification (Strict Consistency)
+    if (existing_len > 0) {
+        BlockHash db_hash;
+        if (get_block_hash(path, block_idx, db_hash) &&
+            !block_matches(db_hash, block_buf, existing_len)) {
+            LOGE("WRITE BLOCKED: Pre-write verification failed for Block " 
+                 << block_idx);
+            return -EIO;
         }
+    }
 
-        // C. Modify buffer in memory
-        // Copy user data into the correct position in the block buffer
-        memcpy(block_buf + offset_in_block, buf + written_so_far, bytes_to_write_here);
-        
-        // Calculate new length of the block (it might have grown)
-        size_t new_len = std::max((size_t)existing_len, offset_in_block + bytes_to_write_here);
+    // C. Modify buffer in memory
+    // Copy user data into the correct position in the block buffer
+    memcpy(block_buf + offset_in_block, data, len);
 
-        // D. Write the full block back to disk
-        // Note: Using pwrite on the block start ensures we don't create holes
-        ssize_t res = pwrite(fd, block_buf, new_len, block_start);
-        if (res == -1) return -errno;
+    // Calculate new length of the block (it might have grown)
+    size_t new_len = std::max((size_t)existing_len, offset_in_block + len);
 
-        // E. Update Database
-        uint64_t new_hash = FNV_OFFSET_BASIS;
-        update_fnv1a(new_hash, block_buf, new_len);
-        
-        std::ostringstream oss; oss << std::hex << new_hash;
-        set_db_block_hash(path, block_idx, oss.str());
+    // D. Write the full block back to disk
+    // Note: Using pwrite on the block start ensures we don't create holes
+    if (pwrite_full(fd, block_buf, new_len, block_start) == -1) return -errno;
+
+    // E. Update Database
+    set_block_hash(path, block_idx, checksum_of(checksum_algo, block_buf, new_len));
+
+    return len;
+}
+
+// Fast path for blocks the write fully covers: whatever was there is replaced
+// wholesale, so there is nothing to read back or verify. Hash straight from the
+// caller's buffer (on the pool while the pwrite runs) and write the whole run
+// with one pwrite. The hashes are stored only after the data is written.
+static int write_full_blocks(const char* path, int fd, const char* data,
+                             size_t nblocks, int64_t first_block) {
+    std::vector<uint64_t> hashes(nblocks);
+    HashRun run;
+    hash_blocks_async(run, data, nblocks, hashes.data());
+    ssize_t written = pwrite_full(fd, data, nblocks * BLOCK_SIZE, first_block * BLOCK_SIZE);
+    int err = errno;
+    hash_blocks_join(run);  // workers read `data`: always wait for them
+    if (written == -1) return -err;
+
+    set_block_hashes(path, first_block, hashes.data(), nblocks);
+
+    return nblocks * BLOCK_SIZE;
+}
+
+static int write_blocks(const char* path, const char* buf, size_t size,
+                        off_t offset, int fd) {
+    size_t done = 0;
 
-        // Advance
-        written_so_far += bytes_to_write_here;
+    // Head: starts mid-block, or too short to fill one
+    off_t head_in_block = offset % BLOCK_SIZE;
+    if (head_in_block != 0 || size < BLOCK_SIZE) {
+        size_t len = std::min(size, BLOCK_SIZE - head_in_block);
+        int res = write_partial_block(path, fd, buf, len, offset);
+        if (res < 0) return res;
+        done += len;
+    }
+
+    // Middle: whole blocks
+    size_t nblocks = (size - done) / BLOCK_SIZE;
+    if (nblocks > 0) {
+        int res = write_full_blocks(path, fd, buf + done, nblocks,
+                                    get_block_index(offset + done));
+        if (res < 0) return res;
+        done += nblocks * BLOCK_SIZE;
+    }
+
+    // Tail: whatever is left of the last block
+    if (done < size) {
+        int res = write_partial_block(path, fd, buf + done, size - done, offset + done);
+        if (res < 0) return res;
     }
 
     return size;
 }
 
-static int fs_truncate(const char* path, off_t size) {
-    std::string real = full_path(path);
-    if (truncate(real.c_str(), size) == -1) return -errno;
+static int fs_write(const char* path, const char* buf, size_t size,
+                    off_t offset, struct fuse_file_info* fi) {
+    // All block hash upserts of this write land in one transaction.
+    // Blocks already written before an error still get their hashes committed.
+    if (is_quarantined(path)) return -EIO;
+    begin_write_batch();
+    int res = write_blocks(path, buf, size, offset, (int)fi->fh);
+    end_write_batch(size);
+    return res;
+}
 
-    // 1. Calculate which block is now the last one
-    int64_t last_block_idx = get_block_index(size);
-    
-    // 2. Delete any blocks that are now completely beyond the EOF
-    // (e.g., if we shrunk from 10KB to 1KB, blocks 1 and 2 are gone)
-    if (size % BLOCK_SIZE == 0) {
-        // Exact boundary: delete everything starting from this index
-        delete_hashes_after_index(path, last_block_idx - 1); // careful logic needed here
-        // Actually, easier logic: delete strictly greater than last index
-        const char* sql = "DELETE FROM block_hashes WHERE path=? AND block_index > ?";
-        // Simple implementation:
-        // If size=0, delete all.
-        if (size == 0) delete_file_hashes(path);
-    } else {
-        // We cut into the middle of a block. We must re-hash that last partial block.
-        // But for this simple implementation, let's just delete the future blocks.
-        const char* sql = "DELETE FROM block_hashes WHERE path=? AND block_index > ?";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int64(stmt, 2, last_block_idx);
-            sqlite3_step(stmt);
-            sqlite3_finalize(stmt);
+// Only the block the new EOF falls in changes content: it keeps a prefix of
+// its old bytes and, on extension, gains zeros up to the block end or the new
+// size. That block is read once (aligned), verified, and rehashed. Every row
+// past it goes in one range delete, in the same transaction as the new tail
+// hash, whatever the sizes. Blocks an extension adds entirely are holes with no
+// row, like any block never written through the mount.
+static int fs_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
+    int fd = fi ? (int)fi->fh : -1;
+    if (fd == -1) {
+        AtPath at;
+        if (int rc = at_path(path, at)) return rc;
+        fd = openat(at.fd(), at.name, O_RDWR);
+        if (fd == -1) return -errno;
+    }
+    auto close_own = [&] { if (!fi) close(fd); };
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close_own();
+        return -err;
+    }
+
+    // Bytes that survive, and the block holding the last of them if it is partial
+    off_t keep = std::min(size, st.st_size);
+    int64_t tail_idx = get_block_index(keep);
+    size_t tail_kept = keep % BLOCK_SIZE;
+
+    char block_buf[BLOCK_SIZE];
+    uint64_t tail_hash = 0;
+    if (tail_kept > 0) {
+        memset(block_buf, 0, BLOCK_SIZE);
+        ssize_t got = pread_full(fd, block_buf, BLOCK_SIZE, tail_idx * BLOCK_SIZE);
+        if (got == -1) {
+            int err = errno;
+            close_own();
+            return -err;
         }
-        
-        // Re-hash the last block (the one we cut in half)
-        // Note: Real implementation would read it. For brevity, we skip re-hashing here
-        // or rely on next read/write to fix it. Ideally:
-        // uint64_t h = compute_hash_of_last_block(real, size);
-        // set_db_block_hash(path, last_block_idx, h);
+        // Strict consistency: don't seal a fresh hash over a corrupted prefix
+        BlockHash db_hash;
+        if (got > 0 && get_block_hash(path, tail_idx, db_hash) &&
+            !block_matches(db_hash, block_buf, got)) {
+            LOGE("TRUNCATE BLOCKED: Pre-truncate verification failed for Block "
+                 << tail_idx);
+            close_own();
+            return -EIO;
+        }
+        memset(block_buf + tail_kept, 0, BLOCK_SIZE - tail_kept);
+        size_t new_len = std::min<off_t>(BLOCK_SIZE, size - tail_idx * BLOCK_SIZE);
+        tail_hash = checksum_of(checksum_algo, block_buf, new_len);
     }
 
+    if (ftruncate(fd, size) == -1) {
+        int err = errno;
+        close_own();
+        return -err;
+    }
+    close_own();
+
+    begin_write_batch();
+    if (tail_kept > 0) truncate_block_hashes(path, tail_idx, &tail_hash);
+    else truncate_block_hashes(path, tail_idx - 1, nullptr);
+    end_write_batch(0);
+
+    flush_write_batch();
     return 0;
 }
 
 static int fs_unlink(const char* path) {
-    std::string real = full_path(path);
-    if (unlink(real.c_str()) == -1) return -errno;
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (unlinkat(at.fd(), at.name, 0) == -1) return -errno;
     
     // Cleanup DB
-    delete_file_hashes(path);
+    delete_file_entry(path);
     
     // Clean metadata table too
-    const char* sql = "DELETE FROM metadata WHERE path=?;";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-    }
+    delete_file_metadata(path);
+    flush_write_batch();
     return 0;
 }
 
 static int fs_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
-    std::string real = full_path(path);
-    int fd = open(real.c_str(), fi->flags, mode);
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    int fd = openat(at.fd(), at.name, backing_open_flags(fi->flags), mode);
     if (fd == -1) return -errno;
     fi->fh = fd;
-    // New file = no blocks yet. No action needed.
+    // New file = no blocks yet. A file quarantined from this path is no longer it.
+    set_quarantined(path, false);
     return 0;
 }
 
 // ... Standard boilerplate pass-throughs ...
 static int fs_mkdir(const char* path, mode_t mode) {
-    if (mkdir(full_path(path).c_str(), mode) == -1) return -errno;
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (mkdirat(at.fd(), at.name, mode) == -1) return -errno;
     return 0;
 }
 static int fs_rmdir(const char* path) {
-    if (rmdir(full_path(path).c_str()) == -1) return -errno;
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (unlinkat(at.fd(), at.name, AT_REMOVEDIR) == -1) return -errno;
+    backing_dir_invalidate(path);
     return 0;
 }
-static int fs_rename(const char* from, const char* to) {
-    if (rename(full_path(from).c_str(), full_path(to).c_str()) == -1) return -errno;
-    // DB Update: Rename all blocks
-    const char* sql = "UPDATE block_hashes SET path=? WHERE path=?";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, to, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, from, -1, SQLITE_TRANSIENT);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+static int fs_rename(const char* from, const char* to, unsigned int flags) {
+    // RENAME_EXCHANGE would have to swap the two files' IDs; not supported
+    if (flags & ~RENAME_NOREPLACE) return -EINVAL;
+    AtPath at_from, at_to;
+    if (int rc = at_path(from, at_from)) return rc;
+    if (int rc = at_path(to, at_to)) return rc;
+    if (renameat2(at_from.fd(), at_from.name, at_to.fd(), at_to.name, flags) == -1) {
+        return -errno;
     }
+    // Cached directory fds under either name no longer match their paths
+    backing_dir_invalidate(from);
+    backing_dir_invalidate(to);
+    // DB Update: repoint the file (or every file under the directory)
+    struct stat st;
+    bool is_dir = fstatat(at_to.fd(), at_to.name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                  S_ISDIR(st.st_mode);
+    rename_file_entry(from, to, is_dir);
+    set_quarantined(to, false);
+    flush_write_batch();
     return 0;
 }
-static int fs_utimens(const char* path, const struct timespec tv[2]) {
-    if (utimensat(0, full_path(path).c_str(), tv, 0) == -1) return -errno;
+static int fs_utimens(const char* path, const struct timespec tv[2],
+                      struct fuse_file_info* fi) {
+    if (fi && fi->fh) {
+        if (futimens((int)fi->fh, tv) == -1) return -errno;
+        return 0;
+    }
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (utimensat(at.fd(), at.name, tv, 0) == -1) return -errno;
     return 0;
 }
 
+// The Merkle root, as "<algo>:<16 hex digits>", is the only xattr; it is read-only
+static int fs_getxattr(const char* path, const char* name, char* value, size_t size) {
+    if (strcmp(name, MERKLE_XATTR) != 0) return -ENODATA;
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    struct stat st;
+    if (fstatat(at.fd(), at.name, &st, AT_SYMLINK_NOFOLLOW) == -1) return -errno;
+    if (!S_ISREG(st.st_mode)) return -ENODATA;
+
+    uint64_t nblocks = ((uint64_t)st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t root;
+    if (!merkle_root(path, nblocks, root)) return -ENODATA;  // not every block is hashed
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)root);
+    std::string v = std::string(checksum_name(checksum_algo)) + ":" + hex;
+
+    if (size == 0) return v.size();
+    if (size < v.size()) return -ERANGE;
+    memcpy(value, v.data(), v.size());
+    return v.size();
+}
+
+static int fs_listxattr(const char* path, char* list, size_t size) {
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    struct stat st;
+    if (fstatat(at.fd(), at.name, &st, AT_SYMLINK_NOFOLLOW) == -1) return -errno;
+    if (!S_ISREG(st.st_mode)) return 0;
+
+    size_t len = strlen(MERKLE_XATTR) + 1;
+    if (size == 0) return len;
+    if (size < len) return -ERANGE;
+    memcpy(list, MERKLE_XATTR, len);
+    return len;
+}
+
 // --- SETUP ---
 
 static int fs_init_db() {
     std::string db_path = full_path("/.metadata.db");
     sqlite3_open(db_path.c_str(), &meta_db);
+    apply_db_options(meta_db);
     
-    const char* sql =
-        "CREATE TABLE IF NOT EXISTS metadata (path TEXT, key TEXT, value BLOB, PRIMARY KEY(path, key));"
-        "CREATE TABLE IF NOT EXISTS block_hashes ("
-        "  path TEXT NOT NULL,"
-        "  block_index INTEGER NOT NULL,"
-        "  checksum TEXT,"
-        "  PRIMARY KEY(path, block_index)"
-        ");";
-    sqlite3_exec(meta_db, sql, nullptr, nullptr, nullptr);
-    return 0;
+    sqlite3_exec(meta_db,
+        "CREATE TABLE IF NOT EXISTS metadata (path TEXT, key TEXT, value BLOB, PRIMARY KEY(path, key));",
+        nullptr, nullptr, nullptr);
+    sqlite3_exec(meta_db, QUARANTINE_SQL, nullptr, nullptr, nullptr);
+    if (create_block_schema(meta_db) != 0) return -1;
+    return prepare_statements();
 }
 
-static void* fs_init(struct fuse_conn_info* conn) {
-    fs_init_db();
+static void* fs_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    log_start();
+    negotiate_fuse_conn(conn, cfg);
+    kernel_inval_start();
+    hash_pool_start();
+    if (fs_init_db() == 0) {
+        batch_timer_start();
+        scrub_start(scrub_pass);
+    }
     return nullptr;
 }
 
 static void fs_destroy(void* private_data) {
+    scrub_stop();
+    hash_pool_stop();
+    batch_timer_stop();
+    flush_write_batch();
+    finalize_statements();
     if (meta_db) sqlite3_close(meta_db);
+    kernel_inval_stop();
+    backing_close_root();
+    log_stop();
 }
 
 static struct fuse_operations fs_ops;
@@ -408,6 +1732,7 @@ void set_fs_ops() {
     fs_ops.read = fs_read;
     fs_ops.write = fs_write;
     fs_ops.release = fs_release;
+    fs_ops.fsync = fs_fsync;
     fs_ops.create = fs_create;
     fs_ops.unlink = fs_unlink;
     fs_ops.mkdir = fs_mkdir;
@@ -415,6 +1740,39 @@ void set_fs_ops() {
     fs_ops.rename = fs_rename;
     fs_ops.truncate = fs_truncate;
     fs_ops.utimens = fs_utimens;
+    fs_ops.getxattr = fs_getxattr;
+    fs_ops.listxattr = fs_listxattr;
+}
+
+// blockfs's own "-o" options, for strip_shared_options()
+static int parse_blockfs_option(const std::string& key, const std::string& val) {
+    int rc = parse_fuse_conn_option(key, val);
+    if (rc == 0) rc = parse_scrub_option(key, val);
+    if (rc != 0) return rc;
+    if (key == "append_only_dirs") return 1;  // accepted for CLI parity with metadatafs
+
+    if (key == "scrub_trust") {
+        if (val == "on")  { scrub_trust = true;  return 1; }
+        if (val == "off") { scrub_trust = false; return 1; }
+        return -1;
+    }
+    if (key == "block_cache_entries") {
+        char* end = nullptr;
+        unsigned long long v = strtoull(val.c_str(), &end, 10);
+        if (val.empty() || *end != '\0') return -1;
+        block_cache_entries = v;
+        return 1;
+    }
+    unsigned long* num = key == "commit_window_ms" ? &commit_window_ms
+                       : key == "commit_window_kb" ? &commit_window_kb
+                       : key == "hash_threads"     ? &hash_threads
+                       : nullptr;
+    if (!num) return 0;
+    char* end = nullptr;
+    unsigned long v = strtoul(val.c_str(), &end, 10);
+    if (val.empty() || *end != '\0') return -1;
+    *num = v;
+    return 1;
 }
 
 int main(int argc, char* argv[]) {
@@ -422,17 +1780,31 @@ int main(int argc, char* argv[]) {
     
     // 1. Capture the backing directory (our custom arg)
     backing_root = argv[1];
+    if (int rc = backing_open_root(backing_root)) {
+        LOGE("Cannot open backing directory " << backing_root << ": " << strerror(-rc));
+        return 1;
+    }
     
     // 2. Build a clean argument list for FUSE
     // We must SKIP argv[1] because FUSE doesn't know what to do with it.
+    static std::vector<std::string> fuse_opts; // storage for rewritten "-o" lists
+    fuse_opts.reserve(argc);
     int new_argc = 0;
     for(int i=0; i<argc; i++) {
         // SKIP the backing directory (index 1)
         if (i == 1) continue;
 
-        // SKIP our custom append-only flag if present
-        if(strcmp(argv[i], "-o") == 0 && i+1 < argc && strstr(argv[i+1], "append_only")) {
-            i++; 
+        // Strip our custom options ("-o a=b,c" or "-oa=b,c"), keep the rest for FUSE
+        const char* opts = nullptr;
+        if (strcmp(argv[i], "-o") == 0 && i+1 < argc) opts = argv[++i];
+        else if (i > 1 && strncmp(argv[i], "-o", 2) == 0) opts = argv[i] + 2;
+        if (opts) {
+            std::string rest;
+            if (!strip_shared_options(opts, rest, parse_blockfs_option)) return 1;
+            if (!rest.empty()) {
+                fuse_opts.push_back("-o" + rest);
+                argv[new_argc++] = &fuse_opts.back()[0];
+            }
             continue;
         }
         
@@ -444,4 +1816,4 @@ int main(int argc, char* argv[]) {
     
     // 3. Pass the cleaned list (new_argc) to FUSE
     return fuse_main(new_argc, argv, &fs_ops, NULL);
-}
\ No newline at end of file
+}
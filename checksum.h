@@ -0,0 +1,182 @@
+// checksum.h - pluggable data checksum kernels, shared by all AugmentFS binaries.
+//
+// Every kernel is streaming and stateless beyond one uint64_t: the running state
+// after hashing a prefix IS that prefix's checksum. That lets metadatafs resume
+// an append from a stored checksum and blockfs hash blocks in any chunking.
+//
+// The algorithm used for each checksum is stored next to it in .metadata.db, so
+// rows written by an older mount (FNV-1a) keep verifying after the default moves on.
+//
+//   fnv1a  : FNV-1a 64. Original kernel, one multiply per byte (~1 byte/cycle).
+//   crc32c : CRC-32C (Castagnoli). Uses the SSE4.2 / ARMv8 CRC instructions
+//            (8 bytes per instruction) when the CPU has them, slicing-by-8 otherwise.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// Values are persisted in the DB: append only, never renumber.
+enum ChecksumAlgo : int {
+    CHECKSUM_FNV1A  = 0,
+    CHECKSUM_CRC32C = 1,
+};
+
+// Algorithm used for new checksums on this mount (-o checksum=fnv1a|crc32c)
+static ChecksumAlgo checksum_algo = CHECKSUM_CRC32C;
+
+// --- FNV-1a 64 ---
+
+static const uint64_t FNV_OFFSET_BASIS = 1469598103934665603ULL;
+static const uint64_t FNV_PRIME        = 1099511628211ULL;
+
+static inline void update_fnv1a(uint64_t &hash, const char* buf, size_t size) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<uint64_t>(p[i]);
+        hash *= FNV_PRIME;
+    }
+}
+
+// --- CRC-32C ---
+// Same convention as zlib's crc32(): pass the previous result to continue, 0 to start.
+
+static const uint32_t CRC32C_POLY = 0x82F63B78u; // reflected Castagnoli polynomial
+
+struct Crc32cTables {
+    uint32_t t[8][256];
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int s = 1; s < 8; ++s) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+        }
+    }
+};
+
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t n) {
+    static const Crc32cTables tab;
+    const auto& t = tab.t;
+    while (n && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+        n--;
+    }
+    while (n >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = crc;
+    while (n && (reinterpret_cast<uintptr_t>(p) & 7)) { c = _mm_crc32_u8((uint32_t)c, *p++); n--; }
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        n -= 8;
+    }
+    while (n--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+static inline bool crc32c_hw_available() {
+    static const bool ok = __builtin_cpu_supports("sse4.2");
+    return ok;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n) {
+    while (n && (reinterpret_cast<uintptr_t>(p) & 7)) { crc = __crc32cb(crc, *p++); n--; }
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        n -= 8;
+    }
+    while (n--) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+static inline bool crc32c_hw_available() { return true; }
+#else
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n) {
+    return crc32c_sw(crc, p, n);
+}
+static inline bool crc32c_hw_available() { return false; }
+#endif
+
+static inline uint32_t crc32c(uint32_t crc, const char* buf, size_t size) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
+    crc = ~crc;
+    crc = crc32c_hw_available() ? crc32c_hw(crc, p, size) : crc32c_sw(crc, p, size);
+    return ~crc;
+}
+
+// --- Dispatch ---
+
+static inline uint64_t checksum_init(ChecksumAlgo algo) {
+    return algo == CHECKSUM_FNV1A ? FNV_OFFSET_BASIS : 0;
+}
+
+static inline void checksum_update(ChecksumAlgo algo, uint64_t& state,
+                                   const char* buf, size_t size) {
+    if (algo == CHECKSUM_FNV1A) {
+        update_fnv1a(state, buf, size);
+    } else {
+        state = crc32c((uint32_t)state, buf, size);
+    }
+}
+
+static inline uint64_t checksum_of(ChecksumAlgo algo, const char* buf, size_t size) {
+    uint64_t state = checksum_init(algo);
+    checksum_update(algo, state, buf, size);
+    return state;
+}
+
+static inline const char* checksum_name(ChecksumAlgo algo) {
+    return algo == CHECKSUM_FNV1A ? "fnv1a" : "crc32c";
+}
+
+static inline bool checksum_from_name(const std::string& name, ChecksumAlgo& out) {
+    if (name == "fnv1a")  { out = CHECKSUM_FNV1A;  return true; }
+    if (name == "crc32c") { out = CHECKSUM_CRC32C; return true; }
+    return false;
+}
+
+// Map a stored DB value back to an algorithm. Unknown ids (from a newer build)
+// are reported as not verifiable rather than guessed.
+static inline bool checksum_from_id(int64_t id, ChecksumAlgo& out) {
+    if (id == CHECKSUM_FNV1A || id == CHECKSUM_CRC32C) {
+        out = static_cast<ChecksumAlgo>(id);
+        return true;
+    }
+    return false;
+}
+
+// Try to consume one "key=value" mount option.
+// Returns 1 if consumed, 0 if the key is not ours, -1 if the value is invalid.
+static inline int parse_checksum_option(const std::string& key, const std::string& val) {
+    if (key != "checksum") return 0;
+    return checksum_from_name(val, checksum_algo) ? 1 : -1;
+}
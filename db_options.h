@@ -0,0 +1,199 @@
+// db_options.h - SQLite setup for .metadata.db, shared by all AugmentFS binaries:
+// tuning options and the one-time schema converters.
+//
+// strip_shared_options() also consumes checksum=... (see checksum.h) and
+// log_level=... (see log.h), so each binary only has one place to pull shared
+// options out of a "-o" list.
+//
+// Mount options (all optional, passed with -o):
+//   db_journal=delete|truncate|persist|wal   journal mode       (default: delete)
+//   db_sync=off|normal|full|extra            synchronous level  (default: full)
+//   db_checkpoint=N                          WAL auto-checkpoint every N pages (default: 1000)
+//   db_mmap=N                                memory-map up to N MB of the DB   (default: 0)
+//
+// Durability of checksum updates per mode:
+//   delete/truncate/persist + full : every commit survives power loss. (SQLite default)
+//   delete/truncate/persist + normal: a power loss at the wrong moment can corrupt the DB.
+//   wal + full  : every commit survives power loss; readers never block the writer.
+//   wal + normal: the DB is always consistent, but a power loss can roll back the
+//                 commits made since the last WAL sync. A process crash loses nothing.
+//   any  + off  : only safe against process crashes; an OS crash can corrupt the DB.
+// A lost checksum update is fail-closed: the data it covered reads back as EIO.
+#pragma once
+
+#include <sqlite3.h>
+#include <string>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+#include "checksum.h"
+#include "log.h"
+
+struct DbOptions {
+    std::string journal = "delete";
+    std::string sync    = "full";
+    long checkpoint_pages = 1000;
+    long mmap_mb = 0;
+};
+
+static DbOptions db_options;
+
+// Try to consume one "key=value" mount option.
+// Returns 1 if consumed, 0 if the key is not ours, -1 if the value is invalid.
+static int parse_db_option(const std::string& key, const std::string& val) {
+    if (key == "db_journal") {
+        if (val != "delete" && val != "truncate" && val != "persist" && val != "wal") return -1;
+        db_options.journal = val;
+        return 1;
+    }
+    if (key == "db_sync") {
+        if (val != "off" && val != "normal" && val != "full" && val != "extra") return -1;
+        db_options.sync = val;
+        return 1;
+    }
+    if (key == "db_checkpoint") {
+        char* end = nullptr;
+        long n = strtol(val.c_str(), &end, 10);
+        if (val.empty() || *end || n < 0) return -1;
+        db_options.checkpoint_pages = n;
+        return 1;
+    }
+    if (key == "db_mmap") {
+        char* end = nullptr;
+        long n = strtol(val.c_str(), &end, 10);
+        if (val.empty() || *end || n < 0) return -1;
+        db_options.mmap_mb = n;
+        return 1;
+    }
+    return 0;
+}
+
+// Remove the db_*, checksum and log_level entries from a comma-separated "-o" list; the rest
+// is left in `rest`. `extra`, if given, is tried for the caller's own options
+// (same return convention as parse_db_option).
+// Returns false (after printing why) if a value is invalid.
+typedef int (*OptionParser)(const std::string& key, const std::string& val);
+
+static bool strip_shared_options(const char* opts, std::string& rest,
+                                 OptionParser extra = nullptr) {
+    std::stringstream ss(opts);
+    std::string item;
+    rest.clear();
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        std::string val = (eq == std::string::npos) ? "" : item.substr(eq + 1);
+
+        int rc = parse_db_option(key, val);
+        if (rc == 0) rc = parse_checksum_option(key, val);
+        if (rc == 0) rc = parse_log_option(key, val);
+        if (rc == 0 && extra) rc = extra(key, val);
+        if (rc < 0) {
+            LOGE("Invalid value for " << key << ": '" << val << "'");
+            return false;
+        }
+        if (rc > 0) continue;
+
+        if (!rest.empty()) rest += ',';
+        rest += item;
+    }
+    return true;
+}
+
+// Apply db_options to a freshly opened connection. Must run before the first
+// transaction, since journal_mode cannot change inside one.
+static int apply_db_options(sqlite3* db) {
+    std::string sql =
+        "PRAGMA journal_mode=" + db_options.journal + ";"
+        "PRAGMA synchronous=" + db_options.sync + ";"
+        "PRAGMA mmap_size=" + std::to_string(db_options.mmap_mb * 1024 * 1024) + ";";
+    if (db_options.journal == "wal") {
+        sql += "PRAGMA wal_autocheckpoint=" + std::to_string(db_options.checkpoint_pages) + ";";
+    }
+
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LOGE("apply_db_options failed: " << (errmsg ? errmsg : "?"));
+        sqlite3_free(errmsg);
+        return -1;
+    }
+    return 0;
+}
+
+// --- Binary checksum migration ---
+// Checksums used to be stored as hex TEXT ("cbf29ce484222325"). They are now
+// INTEGER columns holding the 64-bit value bit-cast to a signed int64, which
+// removes all string formatting from the hot path and halves the row size.
+
+// hex_to_int64(text) SQL function used by the converter. Non-text values pass through.
+static void sql_hex_to_int64(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    (void) argc;
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+    const char* txt = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    if (!txt || !*txt) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    sqlite3_result_int64(ctx, (sqlite3_int64)strtoull(txt, nullptr, 16));
+}
+
+static void register_hex_to_int64(sqlite3* db) {
+    sqlite3_create_function(db, "hex_to_int64", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                            nullptr, sql_hex_to_int64, nullptr, nullptr);
+}
+
+// Rebuild `table` with an INTEGER checksum column if it still has the old TEXT one.
+// `create_sql` must create the current schema of `table`. Runs in one transaction,
+// so an interrupted conversion leaves the old table untouched.
+static int migrate_checksum_column(sqlite3* db, const std::string& table,
+                                   const std::string& create_sql) {
+    // 1. Inspect the current schema
+    std::vector<std::string> columns;
+    bool is_text = false;
+    sqlite3_stmt* stmt = nullptr;
+    std::string info = "PRAGMA table_info(" + table + ");";
+    if (sqlite3_prepare_v2(db, info.c_str(), -1, &stmt, nullptr) != SQLITE_OK) return -1;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::string name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        const unsigned char* type = sqlite3_column_text(stmt, 2);
+        if (name == "checksum" && type && sqlite3_stricmp(reinterpret_cast<const char*>(type), "TEXT") == 0) {
+            is_text = true;
+        }
+        columns.push_back(name);
+    }
+    sqlite3_finalize(stmt);
+    if (!is_text) return 0;
+
+    LOGI("Converting table " << table << ": hex TEXT checksums -> INTEGER");
+
+    // 2. Copy every row into a table with the new schema, parsing hex on the way
+    register_hex_to_int64(db);
+    std::string cols, exprs;
+    for (const auto& c : columns) {
+        if (!cols.empty()) { cols += ","; exprs += ","; }
+        cols  += c;
+        exprs += (c == "checksum") ? "hex_to_int64(checksum)" : c;
+    }
+    std::string sql =
+        "BEGIN IMMEDIATE;"
+        "ALTER TABLE " + table + " RENAME TO " + table + "_hex;" +
+        create_sql +
+        "INSERT INTO " + table + "(" + cols + ") SELECT " + exprs + " FROM " + table + "_hex;"
+        "DROP TABLE " + table + "_hex;"
+        "COMMIT;";
+
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LOGE("migrate_checksum_column(" << table << ") failed: "
+             << (errmsg ? errmsg : "?"));
+        sqlite3_free(errmsg);
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,179 @@
+// fuse_conn.h - FUSE 3 connection setup, shared by all AugmentFS binaries.
+//
+// Mount options (passed with -o):
+//   writeback=on|off       kernel writeback cache (default: on)
+//   attr_timeout=SECS      how long the kernel trusts cached attributes (default: 30)
+//   entry_timeout=SECS     how long the kernel trusts cached names (default: 30)
+//   negative_timeout=SECS  how long the kernel remembers missing names (default: 5)
+//
+// negotiate_fuse_conn() runs from each binary's init hook and asks the kernel
+// for large writes, readdirplus, parallel directory operations, spliced read
+// replies and (unless writeback=off) the writeback cache.
+//
+// The timeouts are longer than libfuse's (1s, 1s, 0s) so that stat storms are
+// answered from the kernel caches. Every change made through the mount already
+// updates or drops the kernel's entry when its reply arrives. Anything the
+// filesystem changes on its own must call kernel_invalidate(). Changes made
+// directly in the backing directory can stay invisible for up to the timeout.
+//
+// With the writeback cache the kernel gathers small writes in the page cache
+// and sends them later as large page-aligned writes, in whatever order its
+// writeback runs and through any writable handle of the inode. Consequences
+// for the backing files:
+//   - The kernel may read through a write-only handle to fill a partial page,
+//     so O_WRONLY is opened O_RDWR.
+//   - The kernel resolves O_APPEND itself and sends explicit offsets. The
+//     backing fd must not be O_APPEND: Linux pwrite() on one ignores the offset.
+// backing_open_flags() applies both.
+#pragma once
+
+#include <fuse.h>  // FUSE_USE_VERSION is set by the including .cpp
+#include <fcntl.h>
+#include <errno.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "log.h"
+
+// Requested max_write. libfuse clamps it to its receive buffer (1 MiB on current versions).
+static const unsigned FUSE_MAX_WRITE = 1024 * 1024;
+
+static bool writeback_wanted = true;   // -o writeback=on|off
+static bool writeback_active = false;  // granted by the kernel in init
+
+// Kernel cache timeouts in seconds (-o attr_timeout=, entry_timeout=, negative_timeout=)
+static double attr_timeout     = 30.0;
+static double entry_timeout    = 30.0;
+static double negative_timeout = 5.0;
+
+static inline bool parse_timeout(const std::string& val, double& out) {
+    char* end = nullptr;
+    double t = strtod(val.c_str(), &end);
+    if (val.empty() || *end != '\0' || !(t >= 0)) return false;
+    out = t;
+    return true;
+}
+
+// Try to consume one "key=value" mount option.
+// Returns 1 if consumed, 0 if the key is not ours, -1 if the value is invalid.
+static inline int parse_fuse_conn_option(const std::string& key, const std::string& val) {
+    if (key == "writeback") {
+        if (val == "on")  { writeback_wanted = true;  return 1; }
+        if (val == "off") { writeback_wanted = false; return 1; }
+        return -1;
+    }
+    double* timeout = key == "attr_timeout"     ? &attr_timeout
+                    : key == "entry_timeout"    ? &entry_timeout
+                    : key == "negative_timeout" ? &negative_timeout
+                    : nullptr;
+    if (!timeout) return 0;
+    return parse_timeout(val, *timeout) ? 1 : -1;
+}
+
+static void negotiate_fuse_conn(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    conn->max_write = FUSE_MAX_WRITE;
+    cfg->attr_timeout     = attr_timeout;
+    cfg->entry_timeout    = entry_timeout;
+    cfg->negative_timeout = negative_timeout;
+
+    if (conn->capable & FUSE_CAP_READDIRPLUS)     conn->want |= FUSE_CAP_READDIRPLUS;
+    if (conn->capable & FUSE_CAP_PARALLEL_DIROPS) conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+    // Lets fd-backed read_buf replies reach the kernel by splice(2); plain
+    // memory replies are sent as before
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)    conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+    writeback_active = writeback_wanted && (conn->capable & FUSE_CAP_WRITEBACK_CACHE);
+    if (writeback_active) conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+
+    LOGI("FUSE connection: max_write=" << conn->max_write
+         << " writeback=" << (writeback_active ? "on" : "off")
+         << " readdirplus=" << ((conn->want & FUSE_CAP_READDIRPLUS) ? "on" : "off")
+         << " parallel_dirops=" << ((conn->want & FUSE_CAP_PARALLEL_DIROPS) ? "on" : "off")
+         << " splice=" << ((conn->want & FUSE_CAP_SPLICE_WRITE) ? "on" : "off"));
+    LOGI("Kernel cache: attr_timeout=" << attr_timeout << "s entry_timeout=" << entry_timeout
+         << "s negative_timeout=" << negative_timeout << "s");
+}
+
+// --- Kernel cache invalidation ---
+//
+// Notifications are sent from a thread of their own, never from inside a FUSE
+// operation. The kernel may hold the locks that an invalidation needs while it
+// waits for that operation's reply, so sending it there can deadlock.
+
+struct InvalQueue {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::string> paths;
+    bool stop = false;
+    std::atomic<bool> running{false};
+    std::thread worker;
+    struct fuse* fuse = nullptr;
+};
+
+static InvalQueue inval_queue;
+
+static void kernel_inval_drain() {
+    std::unique_lock<std::mutex> lock(inval_queue.mtx);
+    for (;;) {
+        inval_queue.cv.wait(lock, [] { return !inval_queue.paths.empty() || inval_queue.stop; });
+        if (inval_queue.paths.empty()) return;  // stopping
+
+        std::string path = std::move(inval_queue.paths.front());
+        inval_queue.paths.pop_front();
+        lock.unlock();
+        // -ENOENT: the kernel has nothing cached for it
+        int rc = fuse_invalidate_path(inval_queue.fuse, path.c_str());
+        if (rc != 0 && rc != -ENOENT) {
+            LOGW("kernel_invalidate: " << path << " failed: " << strerror(-rc));
+        } else {
+            LOGD("kernel_invalidate: " << path);
+        }
+        lock.lock();
+    }
+}
+
+// Start the notification thread. Call from the FUSE init hook.
+static void kernel_inval_start() {
+    inval_queue.fuse = fuse_get_context()->fuse;
+    inval_queue.stop = false;
+    inval_queue.worker = std::thread(kernel_inval_drain);
+    inval_queue.running = true;
+}
+
+// Drop what is still queued and stop. Call from the FUSE destroy hook.
+static void kernel_inval_stop() {
+    if (!inval_queue.running) return;
+    inval_queue.running = false;
+    {
+        std::lock_guard<std::mutex> lock(inval_queue.mtx);
+        inval_queue.paths.clear();
+        inval_queue.stop = true;
+    }
+    inval_queue.cv.notify_one();
+    inval_queue.worker.join();
+}
+
+// Make the kernel forget the attributes, name and cached pages of `path`
+static void kernel_invalidate(const char* path) {
+    if (!inval_queue.running.load(std::memory_order_acquire)) return;
+    {
+        std::lock_guard<std::mutex> lock(inval_queue.mtx);
+        inval_queue.paths.emplace_back(path);
+    }
+    inval_queue.cv.notify_one();
+}
+
+// open(2) flags for the backing file of a FUSE open/create
+static inline int backing_open_flags(int flags) {
+    if (!writeback_active) return flags;
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    return flags & ~O_APPEND;
+}
@@ -0,0 +1,181 @@
+// log.h - leveled logging, shared by all AugmentFS binaries.
+//
+// Call sites use the LOGE/LOGW/LOGI/LOGD macros with a stream expression:
+//     LOGD("fs_getattr: " << path << " -> " << real);
+// The expression is only evaluated when the line will actually be written.
+//
+// Two filters apply:
+//   LOG_COMPILED_LEVEL (build time, -DLOG_COMPILED_LEVEL=N): levels above it
+//     compile to nothing. `make RELEASE=1` builds with 1 (errors and warnings).
+//   log_level=error|warn|info|debug (mount option, default info): levels above
+//     it cost one relaxed atomic load and a compare.
+//
+// Errors and warnings go straight to stderr. Info and debug lines go to stdout;
+// at log_level=debug they are handed to a ring buffer drained by a background
+// thread, so a traced getattr never waits on the terminal. Lines that find the
+// ring full are dropped and counted rather than blocking the FUSE thread.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Plain ints so they can also be used in -DLOG_COMPILED_LEVEL
+enum LogLevel : int {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN  = 1,
+    LOG_LEVEL_INFO  = 2,
+    LOG_LEVEL_DEBUG = 3,
+};
+
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Runtime level (-o log_level=...)
+static std::atomic<int> log_level{LOG_LEVEL_INFO};
+
+static inline const char* log_level_name(int level) {
+    switch (level) {
+        case LOG_LEVEL_ERROR: return "error";
+        case LOG_LEVEL_WARN:  return "warn";
+        case LOG_LEVEL_INFO:  return "info";
+        default:              return "debug";
+    }
+}
+
+// --- Async sink ---
+
+static const size_t LOG_RING_SLOTS = 4096;
+static const size_t LOG_LINE_MAX   = 256;  // longer lines are cut
+
+struct LogRing {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<char> lines;         // LOG_RING_SLOTS * LOG_LINE_MAX
+    std::vector<uint16_t> lens;
+    size_t head = 0;                 // next slot to fill
+    size_t count = 0;                // filled slots
+    uint64_t dropped = 0;
+    bool stop = false;
+    std::atomic<bool> running{false};
+    std::thread writer;
+};
+
+static LogRing log_ring;
+
+static void log_ring_drain() {
+    std::string out;
+    std::unique_lock<std::mutex> lock(log_ring.mtx);
+    for (;;) {
+        log_ring.cv.wait(lock, [] { return log_ring.count > 0 || log_ring.stop; });
+
+        // Copy everything pending out under the lock, write it without
+        out.clear();
+        size_t tail = (log_ring.head + LOG_RING_SLOTS - log_ring.count) % LOG_RING_SLOTS;
+        for (; log_ring.count > 0; --log_ring.count, tail = (tail + 1) % LOG_RING_SLOTS) {
+            out.append(&log_ring.lines[tail * LOG_LINE_MAX], log_ring.lens[tail]);
+        }
+        uint64_t dropped = log_ring.dropped;
+        log_ring.dropped = 0;
+        bool stop = log_ring.stop;
+
+        lock.unlock();
+        if (dropped) out += "[log] " + std::to_string(dropped) + " lines dropped (ring full)\n";
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        lock.lock();
+
+        if (stop && log_ring.count == 0) return;
+    }
+}
+
+// Start the background writer if the runtime level asks for tracing. Call from
+// the FUSE init hook: threads started before fuse_main() do not survive daemonizing.
+static inline void log_start() {
+    if (log_level.load(std::memory_order_relaxed) < LOG_LEVEL_DEBUG) return;
+    log_ring.lines.resize(LOG_RING_SLOTS * LOG_LINE_MAX);
+    log_ring.lens.resize(LOG_RING_SLOTS);
+    log_ring.stop = false;
+    log_ring.writer = std::thread(log_ring_drain);
+    log_ring.running = true;
+}
+
+// Flush what is queued and stop the writer. Call from the FUSE destroy hook.
+static inline void log_stop() {
+    if (!log_ring.running) return;
+    log_ring.running = false;
+    {
+        std::lock_guard<std::mutex> lock(log_ring.mtx);
+        log_ring.stop = true;
+    }
+    log_ring.cv.notify_one();
+    log_ring.writer.join();
+}
+
+static void log_emit(int level, const std::string& msg) {
+    if (level <= LOG_LEVEL_WARN) {
+        std::string line = msg + '\n';
+        fwrite(line.data(), 1, line.size(), stderr);
+        return;
+    }
+
+    if (!log_ring.running.load(std::memory_order_acquire)) {
+        std::string line = msg + '\n';
+        fwrite(line.data(), 1, line.size(), stdout);
+        return;
+    }
+
+    size_t len = std::min(msg.size(), LOG_LINE_MAX - 1);
+    {
+        std::lock_guard<std::mutex> lock(log_ring.mtx);
+        if (log_ring.count == LOG_RING_SLOTS) {
+            log_ring.dropped++;
+            return;
+        }
+        char* slot = &log_ring.lines[log_ring.head * LOG_LINE_MAX];
+        memcpy(slot, msg.data(), len);
+        slot[len] = '\n';
+        log_ring.lens[log_ring.head] = (uint16_t)(len + 1);
+        log_ring.head = (log_ring.head + 1) % LOG_RING_SLOTS;
+        log_ring.count++;
+    }
+    log_ring.cv.notify_one();
+}
+
+#define LOG_AT(level, expr)                                                    \
+    do {                                                                       \
+        if constexpr ((level) <= LOG_COMPILED_LEVEL) {                         \
+            if ((level) <= log_level.load(std::memory_order_relaxed)) {        \
+                std::ostringstream log_os_;                                    \
+                log_os_ << expr;                                               \
+                log_emit((level), log_os_.str());                              \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+#define LOGE(expr) LOG_AT(LOG_LEVEL_ERROR, expr)
+#define LOGW(expr) LOG_AT(LOG_LEVEL_WARN, expr)
+#define LOGI(expr) LOG_AT(LOG_LEVEL_INFO, expr)
+#define LOGD(expr) LOG_AT(LOG_LEVEL_DEBUG, expr)
+
+// Try to consume one "key=value" mount option.
+// Returns 1 if consumed, 0 if the key is not ours, -1 if the value is invalid.
+static inline int parse_log_option(const std::string& key, const std::string& val) {
+    if (key != "log_level") return 0;
+    for (int l = LOG_LEVEL_ERROR; l <= LOG_LEVEL_DEBUG; ++l) {
+        if (val == log_level_name(l)) {
+            log_level = l;
+            return 1;
+        }
+    }
+    return -1;
+}
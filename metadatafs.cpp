@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 29
+#define FUSE_USE_VERSION 31
 #define _FILE_OFFSET_BITS 64
 
 #include <fuse.h>
@@ -18,66 +18,205 @@
 #include <sstream>
 #include <cstdint>
 #include <cstring>
+#include <mutex>
+#include <atomic>
+#include <string_view>
+#include <memory>
+
+#include "checksum.h"
+#include "db_options.h"
+#include "schema.h"
+#include "log.h"
+#include "fuse_conn.h"
+#include "backing_at.h"
+#include "scrub.h"
 
-static sqlite3* meta_db = nullptr;
 static std::string backing_root;
 
-static std::unordered_map<int, uint64_t> checksum_map; // fd -> running hash
-// FNV-1a 64-bit constants
-static const uint64_t FNV_OFFSET_BASIS = 1469598103934665603ULL;
-static const uint64_t FNV_PRIME        = 1099511628211ULL;
+// Running checksum of a writer fd, in the algorithm its file is stored with
+struct RunningHash {
+    uint64_t state;
+    ChecksumAlgo algo;
+    uint64_t length; // bytes hashed into state
+};
 
-// For read-time verification
-static std::unordered_set<int> verified_ok_fds;    // fds whose checksum matched
-static std::unordered_set<int> verified_bad_fds;   // fds with checksum mismatch
 static std::vector<std::string> append_only_dirs;  // e.g., "/logs", "/backups"
-static std::unordered_multimap<std::string, int> open_path_to_fd;
 
 static bool is_append_only_path(const char* path);
 
-// Update running FNV-1a hash with a buffer
-static void update_fnv1a(uint64_t &hash, const char* buf, size_t size) {
-    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
-    for (size_t i = 0; i < size; ++i) {
-        hash ^= static_cast<uint64_t>(p[i]);
-        hash *= FNV_PRIME;
+// --- DB CONNECTIONS ---
+// libfuse dispatches on several threads. Each one gets its own SQLite connection,
+// opened on first use, so threads never share a handle and reads run in parallel.
+// Writers on different connections queue on SQLite's file lock (busy timeout).
+
+static std::string db_path;
+static std::atomic<bool> db_ready{false};   // schema is in place (fs_init_db)
+
+static std::mutex db_conns_mutex;
+static std::unordered_set<sqlite3*> db_conns;  // every open connection
+
+static sqlite3* open_db_connection() {
+    sqlite3* db = nullptr;
+    int rc = sqlite3_open_v2(db_path.c_str(), &db,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                             nullptr);
+    if (rc != SQLITE_OK) {
+        LOGE("sqlite3_open failed: " << sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    if (apply_db_options(db) != 0) {
+        sqlite3_close(db);
+        return nullptr;
     }
+
+    std::lock_guard<std::mutex> lock(db_conns_mutex);
+    db_conns.insert(db);
+    return db;
+}
+
+static void close_db_connection(sqlite3* db) {
+    std::lock_guard<std::mutex> lock(db_conns_mutex);
+    if (db_conns.erase(db)) sqlite3_close(db);
+}
+
+// Closes the thread's connection when a FUSE worker thread exits
+struct ThreadDb {
+    sqlite3* db = nullptr;
+    ~ThreadDb() { if (db) close_db_connection(db); }
+};
+
+// This thread's connection, or nullptr if the DB is unavailable.
+static sqlite3* thread_db() {
+    static thread_local ThreadDb tdb;
+    if (!db_ready) return nullptr;
+    if (!tdb.db) tdb.db = open_db_connection();
+    return tdb.db;
+}
+
+// --- VERIFICATION CACHE ---
+// Files that passed verify_fd_checksum, keyed by (st_dev, st_ino). An entry is
+// reused only while the file's size/mtime/ctime and its stored checksum are
+// unchanged, so reopening an unmodified file skips the full-file hash. Writers,
+// truncate, rename and unlink through the FS drop the entry explicitly as well,
+// since a write can land within one timestamp tick of the verification.
+// Read-only opens of a file with a fresh entry also keep the kernel page cache.
+
+static const size_t VERIFY_CACHE_MAX = 65536;
+
+struct VerifiedFile {
+    FileFingerprint fp;
+    uint64_t checksum;  // stored checksum the file was verified against
+    ChecksumAlgo algo;
+};
+
+struct DevIno {
+    uint64_t dev;
+    uint64_t ino;
+    bool operator==(const DevIno& o) const { return dev == o.dev && ino == o.ino; }
+};
+
+struct DevInoHash {
+    size_t operator()(const DevIno& k) const {
+        return std::hash<uint64_t>()(k.ino * 0x9E3779B97F4A7C15ULL ^ k.dev);
+    }
+};
+
+static std::mutex verify_cache_mutex;
+static std::unordered_map<DevIno, VerifiedFile, DevInoHash> verify_cache;
+
+static bool verify_cache_hit(const struct stat& st, uint64_t checksum, ChecksumAlgo algo) {
+    std::lock_guard<std::mutex> lock(verify_cache_mutex);
+    auto it = verify_cache.find({(uint64_t)st.st_dev, (uint64_t)st.st_ino});
+    return it != verify_cache.end() && it->second.fp == fingerprint_of(st) &&
+           it->second.checksum == checksum && it->second.algo == algo;
+}
+
+// Unchanged since it last passed verification? Pages the kernel cached from
+// reads of that verified content are then still good. A file that changed
+// behind the FS loses its entry and sets *changed.
+static bool verify_cache_fresh(const struct stat& st, bool* changed) {
+    std::lock_guard<std::mutex> lock(verify_cache_mutex);
+    *changed = false;
+    auto it = verify_cache.find({(uint64_t)st.st_dev, (uint64_t)st.st_ino});
+    if (it == verify_cache.end()) return false;
+    if (it->second.fp == fingerprint_of(st)) return true;
+    verify_cache.erase(it);
+    *changed = true;
+    return false;
+}
+
+static void verify_cache_put(const struct stat& st, uint64_t checksum, ChecksumAlgo algo) {
+    std::lock_guard<std::mutex> lock(verify_cache_mutex);
+    if (verify_cache.size() >= VERIFY_CACHE_MAX) verify_cache.clear();
+    verify_cache[{(uint64_t)st.st_dev, (uint64_t)st.st_ino}] = {fingerprint_of(st), checksum, algo};
+}
+
+static void verify_cache_erase(const struct stat& st) {
+    std::lock_guard<std::mutex> lock(verify_cache_mutex);
+    verify_cache.erase({(uint64_t)st.st_dev, (uint64_t)st.st_ino});
 }
 
-// Store/overwrite checksum(path) in the checksums table
-static int store_checksum(const char* path, uint64_t hash) {
-    if (!meta_db) return -EIO;
+static void verify_cache_erase_fd(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) verify_cache_erase(st);
+}
 
-    // convert hash to hex string
-    std::ostringstream oss;
-    oss << std::hex << hash;
-    std::string checksum = oss.str();
+static void verify_cache_erase_at(const AtPath& at) {
+    struct stat st;
+    if (fstatat(at.fd(), at.name, &st, AT_SYMLINK_NOFOLLOW) == 0) verify_cache_erase(st);
+}
+
+// Checksum as hex for log lines
+static std::string hex64(uint64_t v) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%llx", (unsigned long long)v);
+    return buf;
+}
+
+// Store/overwrite checksum(path) in the checksums table.
+// fp == nullptr stores no fingerprint, so the next append rescans the file.
+static int store_checksum(const char* path, uint64_t hash, ChecksumAlgo algo,
+                          const FileFingerprint* fp) {
+    sqlite3* db = thread_db();
+    if (!db) return -EIO;
 
     const char* sql =
-        "INSERT INTO checksums(path, checksum) "
-        "VALUES(?, ?) "
-        "ON CONFLICT(path) DO UPDATE SET checksum = excluded.checksum;";
+        "INSERT INTO checksums(path, checksum, algo, size, mtime_ns, ctime_ns, ino) "
+        "VALUES(?, ?, ?, ?, ?, ?, ?) "
+        "ON CONFLICT(path) DO UPDATE SET checksum = excluded.checksum, algo = excluded.algo, "
+        "  size = excluded.size, mtime_ns = excluded.mtime_ns, "
+        "  ctime_ns = excluded.ctime_ns, ino = excluded.ino, verified_at = NULL;";
 
     sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr);
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "store_checksum: prepare failed: "
-                  << sqlite3_errmsg(meta_db) << std::endl;
+        LOGE("store_checksum: prepare failed: "
+             << sqlite3_errmsg(db));
         return -EIO;
     }
 
     sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, checksum.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)hash);
+    sqlite3_bind_int64(stmt, 3, algo);
+    if (fp) {
+        sqlite3_bind_int64(stmt, 4, fp->size);
+        sqlite3_bind_int64(stmt, 5, fp->mtime_ns);
+        sqlite3_bind_int64(stmt, 6, fp->ctime_ns);
+        sqlite3_bind_int64(stmt, 7, fp->ino);
+    } // else: left unbound = NULL
 
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
     if (rc != SQLITE_DONE) {
-        std::cerr << "store_checksum: step failed for " << path << std::endl;
+        LOGE("store_checksum: step failed for " << path);
         return -EIO;
     }
 
-    std::cout << "Stored checksum for " << path << ": " << checksum << std::endl;
+    LOGD("Stored checksum for " << path << ": " << hex64(hash)
+         << " (" << checksum_name(algo) << ")");
     return 0;
 }
 
@@ -94,62 +233,353 @@ static std::string full_path(const char* path) {
     return result;
 }
 
-// Compute FNV-1a checksum of the entire file at real_path (used for reads)
-static std::string compute_checksum_for_file(const std::string& real_path) {
-    int fd = open(real_path.c_str(), O_RDONLY);
-    if (fd == -1) {
-        std::cerr << "compute_checksum_for_file: failed to open "
-                  << real_path << std::endl;
-        return "";
-    }
-
-    uint64_t hash = FNV_OFFSET_BASIS;
+// Hash everything readable through fd, from offset 0. `length` (optional)
+// receives the number of bytes hashed. Returns false on a read error.
+static bool hash_fd(int fd, ChecksumAlgo algo, uint64_t& out, uint64_t* length = nullptr) {
+    uint64_t hash = checksum_init(algo);
     char buf[4096];
+    off_t off = 0;
     ssize_t n;
 
-    while ((n = read(fd, buf, sizeof(buf))) > 0) {
-        update_fnv1a(hash, buf, (size_t)n);
+    while ((n = pread(fd, buf, sizeof(buf), off)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        checksum_update(algo, hash, buf, (size_t)n);
+        off += n;
     }
 
-    if (n == -1) {
-        std::cerr << "compute_checksum_for_file: read error on "
-                  << real_path << std::endl;
-        close(fd);
-        return "";
+    out = hash;
+    if (length) *length = (uint64_t)off;
+    return true;
+}
+
+// Hash the backing file of a mount path, opened relative to its cached parent.
+// Returns false if it could not be opened or read.
+static bool compute_checksum_for_file(const char* path, ChecksumAlgo algo,
+                                      uint64_t& out, uint64_t* length = nullptr) {
+    AtPath at;
+    int fd = at_path(path, at) == 0 ? openat(at.fd(), at.name, O_RDONLY) : -1;
+    if (fd == -1) {
+        LOGE("compute_checksum_for_file: failed to open "
+             << path);
+        return false;
     }
 
+    bool ok = hash_fd(fd, algo, out, length);
+    if (!ok) {
+        LOGE("compute_checksum_for_file: read error on "
+             << path);
+    }
     close(fd);
+    return ok;
+}
+
+// Read verification mode (-o verify=upfront|stream)
+//   upfront: hash the whole file before serving the first byte (default)
+//   stream : hash a sequential reader's data as it is served; the read that
+//            reaches EOF returns EIO if the completed hash mismatches. Any
+//            other access pattern falls back to upfront verification.
+// In stream mode a corrupted file's bytes reach the reader before the EIO,
+// and a reader that stops before EOF never gets a verdict.
+enum VerifyMode { VERIFY_UPFRONT, VERIFY_STREAM };
+static VerifyMode verify_mode = VERIFY_UPFRONT;
+
+static int parse_verify_option(const std::string& key, const std::string& val) {
+    if (key != "verify") return 0;
+    if (val == "upfront") { verify_mode = VERIFY_UPFRONT; return 1; }
+    if (val == "stream")  { verify_mode = VERIFY_STREAM;  return 1; }
+    return -1;
+}
+
+// metadatafs's own "-o" options, for strip_shared_options()
+static int parse_metadatafs_option(const std::string& key, const std::string& val) {
+    int rc = parse_verify_option(key, val);
+    if (rc == 0) rc = parse_scrub_option(key, val);
+    return rc != 0 ? rc : parse_fuse_conn_option(key, val);
+}
+
+// What is known about an fd before any of its data is hashed.
+enum VerifyStart { VERIFY_PASSED, VERIFY_FAILED, VERIFY_NEEDS_HASH };
+
+// A verification waiting on a hash pass over the file
+struct PendingVerify {
+    uint64_t expected;
+    ChecksumAlgo algo;
+    struct stat before;  // fstat when the pass started
+    bool have_stat;
+};
+
+// Hash of the bytes [0, next_offset) a verify=stream reader was served so far
+struct StreamVerify {
+    PendingVerify pv;
+    uint64_t state;
+    uint64_t next_offset;
+};
+
+// --- OPEN FILE HANDLES ---
+// Everything tracked for an open file lives in one Handle, and fi->fh points at
+// it, so read/write reach their state without any table lookup. Handles come
+// from a free list refilled a chunk at a time and are never returned to the
+// heap; a recycled Handle keeps its path buffer, so steady-state open/release
+// does not allocate either.
+//
+// Handle fields are guarded by the file lock of the handle's path, which also
+// orders the writes, truncates and hash passes of one file while other files
+// proceed in parallel. `verdict` is atomic so reads of an already-verified
+// handle take no lock at all. fs_rename re-keys the handles of the paths it
+// moves, so a handle's path is always the file's current name; code that locks
+// a handle's file goes through HandleLock.
+// Lock order: file lock, then an open-list shard lock.
+
+enum Verdict { UNVERIFIED, VERIFIED_OK, VERIFIED_BAD };
+
+struct Handle {
+    int fd = -1;
+    bool writer = false;
+    std::string path;                    // current name (see fs_rename)
+    std::atomic<size_t> path_id{0};      // hash of path: file lock stripe, open-list shard
+    RunningHash hash = {};               // writers only
+    bool hash_stale = false;             // a write did not continue at hash.length
+    std::atomic<int> verdict{UNVERIFIED};
+    bool streaming = false;              // `stream` holds a verify=stream pass
+    StreamVerify stream = {};
+    Handle* prev = nullptr;              // open list of the path's shard / free list
+    Handle* next = nullptr;
+};
+
+static const size_t FILE_LOCK_STRIPES = 256;
+static std::mutex file_locks[FILE_LOCK_STRIPES];
+
+static size_t path_id_of(const char* path) {
+    return std::hash<std::string_view>()(path);
+}
+
+static std::mutex& file_lock(size_t path_id) {
+    return file_locks[path_id % FILE_LOCK_STRIPES];
+}
+
+static std::mutex& file_lock(const char* path) {
+    return file_lock(path_id_of(path));
+}
+
+static const size_t HANDLE_CHUNK = 256;
+
+static std::mutex handle_pool_mutex;
+static std::vector<std::unique_ptr<Handle[]>> handle_chunks;
+static Handle* free_handles = nullptr;
+
+// Open handles by path_id, so truncate can reach the writers of one path
+static const size_t OPEN_SHARDS = 16;
+
+struct OpenShard {
+    std::mutex mtx;
+    Handle* head = nullptr;
+};
+
+static OpenShard open_handles[OPEN_SHARDS];
+
+// Writer handles open on any path; lets a lone writer skip the shard walk below
+static std::atomic<int> open_writers{0};
+
+static OpenShard& open_shard(size_t path_id) {
+    return open_handles[path_id % OPEN_SHARDS];
+}
+
+// Caller holds sh.mtx
+static void shard_push(OpenShard& sh, Handle* h) {
+    h->prev = nullptr;
+    h->next = sh.head;
+    if (sh.head) sh.head->prev = h;
+    sh.head = h;
+}
+
+// Caller holds sh.mtx
+static void shard_unlink(OpenShard& sh, Handle* h) {
+    if (h->prev) h->prev->next = h->next;
+    else sh.head = h->next;
+    if (h->next) h->next->prev = h->prev;
+}
+
+// Take a handle from the pool, set it up for (fd, path) and list it as open.
+// Caller holds the path's file lock.
+static Handle* handle_open(int fd, const char* path, bool writer) {
+    Handle* h;
+    {
+        std::lock_guard<std::mutex> lock(handle_pool_mutex);
+        if (!free_handles) {
+            handle_chunks.emplace_back(new Handle[HANDLE_CHUNK]);
+            Handle* chunk = handle_chunks.back().get();
+            for (size_t i = 0; i < HANDLE_CHUNK; ++i) {
+                chunk[i].next = free_handles;
+                free_handles = &chunk[i];
+            }
+        }
+        h = free_handles;
+        free_handles = h->next;
+    }
+
+    h->fd = fd;
+    h->writer = writer;
+    h->path = path;
+    h->path_id = path_id_of(path);
+    h->hash = {};
+    h->hash_stale = false;
+    h->verdict = UNVERIFIED;
+    h->streaming = false;
+
+    if (writer) open_writers++;
+    OpenShard& sh = open_shard(h->path_id);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    shard_push(sh, h);
+    return h;
+}
+
+// Unlist a handle and give it back to the pool. Caller holds its file lock.
+static void handle_close(Handle* h) {
+    {
+        OpenShard& sh = open_shard(h->path_id);
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        shard_unlink(sh, h);
+    }
+    if (h->writer) open_writers--;
+
+    h->fd = -1;
+    std::lock_guard<std::mutex> lock(handle_pool_mutex);
+    h->prev = nullptr;
+    h->next = free_handles;
+    free_handles = h;
+}
+
+// Data reached the file through `h`. Every other writer open on the path (one
+// FUSE inode; with the writeback cache the kernel flushes it through any of
+// them) now has a running hash that misses those bytes. Caller holds the file lock.
+static void writers_mark_stale(const Handle* h) {
+    if (open_writers.load(std::memory_order_relaxed) < 2) return;
+    OpenShard& sh = open_shard(h->path_id);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    for (Handle* o = sh.head; o; o = o->next) {
+        if (o != h && o->writer && o->path_id == h->path_id && o->path == h->path) {
+            o->hash_stale = true;
+        }
+    }
+}
+
+static Handle* handle_of(const struct fuse_file_info* fi) {
+    return reinterpret_cast<Handle*>(static_cast<uintptr_t>(fi->fh));
+}
+
+// Holds the file lock of a handle's current path. fs_rename may re-key the
+// handle while we wait, so the key is checked again once the lock is ours.
+struct HandleLock {
+    std::mutex* m;
+    explicit HandleLock(const Handle* h) {
+        for (;;) {
+            m = &file_lock(h->path_id);
+            m->lock();
+            if (m == &file_lock(h->path_id)) return;
+            m->unlock();
+        }
+    }
+    ~HandleLock() { m->unlock(); }
+    HandleLock(const HandleLock&) = delete;
+    HandleLock& operator=(const HandleLock&) = delete;
+};
+
+// Holds the file locks a rename needs: those of its two paths, in a fixed
+// order. lock_all() trades them for every stripe, in array order, for a
+// directory whose open descendants have to be re-keyed too.
+struct RenameLock {
+    std::mutex* first;
+    std::mutex* second;
+    bool all = false;
+    RenameLock(const char* a, const char* b) : first(&file_lock(a)), second(&file_lock(b)) {
+        if (first == second) second = nullptr;
+        else if (second < first) std::swap(first, second);
+        first->lock();
+        if (second) second->lock();
+    }
+    void lock_all() {
+        if (second) second->unlock();
+        first->unlock();
+        for (std::mutex& m : file_locks) m.lock();
+        all = true;
+    }
+    ~RenameLock() {
+        if (all) {
+            for (size_t i = FILE_LOCK_STRIPES; i-- > 0;) file_locks[i].unlock();
+            return;
+        }
+        if (second) second->unlock();
+        first->unlock();
+    }
+    RenameLock(const RenameLock&) = delete;
+    RenameLock& operator=(const RenameLock&) = delete;
+};
+
+// `from` was renamed to `to`: handles open on it, or on anything beneath it,
+// now belong to the new name. Caller holds a RenameLock covering all of them.
+static void handles_rename(const std::string& from, const std::string& to, bool is_dir) {
+    auto moves = [&](const Handle* h) {
+        return h->path.compare(0, from.size(), from) == 0 &&
+               (h->path.size() == from.size() || (is_dir && h->path[from.size()] == '/'));
+    };
+    std::vector<Handle*> moved;
+    auto take = [&](OpenShard& sh) {
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        for (Handle* h = sh.head; h;) {
+            Handle* next = h->next;
+            if (moves(h)) {
+                shard_unlink(sh, h);
+                moved.push_back(h);
+            }
+            h = next;
+        }
+    };
+    // A file's handles all sit in one shard; a directory's may be anywhere
+    if (is_dir) {
+        for (OpenShard& sh : open_handles) take(sh);
+    } else {
+        take(open_shard(path_id_of(from.c_str())));
+    }
 
-    std::ostringstream oss;
-    oss << std::hex << hash;
-    return oss.str();
+    for (Handle* h : moved) {
+        h->path = to + h->path.substr(from.size());
+        h->path_id = path_id_of(h->path.c_str());
+        OpenShard& sh = open_shard(h->path_id);
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        shard_push(sh, h);
+    }
 }
 
-// Verify checksum for (path, fd) once. Cache result in verified_*_fds.
-static bool verify_fd_checksum(const char* path, int fd) {
+// Settle the fd without hashing if possible (already verified, unprotected,
+// cached). Settled results are recorded in st.verdict. Caller holds the file lock.
+static VerifyStart start_verification(const char* path, Handle& st, PendingVerify& pv) {
     // If we've already verified or rejected this fd, just return cached result.
-    if (verified_ok_fds.count(fd)) {
-        return true;
+    if (st.verdict == VERIFIED_OK) {
+        return VERIFY_PASSED;
     }
-    if (verified_bad_fds.count(fd)) {
-        return false;
+    if (st.verdict == VERIFIED_BAD) {
+        return VERIFY_FAILED;
     }
 
-    if (!meta_db) {
+    sqlite3* db = thread_db();
+    if (!db) {
         // No DB means no integrity info; allow read.
-        verified_ok_fds.insert(fd);
-        return true;
+        st.verdict = VERIFIED_OK;
+        return VERIFY_PASSED;
     }
 
     // 1. Look up stored checksum from DB
-    const char* sql = "SELECT checksum FROM checksums WHERE path = ?;";
+    const char* sql = "SELECT checksum, algo FROM checksums WHERE path = ?;";
     sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr);
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "verify_fd_checksum: prepare failed: "
-                  << sqlite3_errmsg(meta_db) << std::endl;
-        verified_ok_fds.insert(fd);  // fail-open
-        return true;
+        LOGE("verify_fd_checksum: prepare failed: "
+             << sqlite3_errmsg(db));
+        st.verdict = VERIFIED_OK;  // fail-open
+        return VERIFY_PASSED;
     }
 
     sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
@@ -158,110 +588,393 @@ static bool verify_fd_checksum(const char* path, int fd) {
     if (rc != SQLITE_ROW) {
         // No stored checksum for this path -> treat as unprotected, allow read.
         sqlite3_finalize(stmt);
-        verified_ok_fds.insert(fd);
-        return true;
+        st.verdict = VERIFIED_OK;
+        return VERIFY_PASSED;
     }
 
-    const unsigned char* checksum_text = sqlite3_column_text(stmt, 0);
-    std::string stored_checksum =
-        checksum_text ? reinterpret_cast<const char*>(checksum_text) : "";
+    bool has_checksum = sqlite3_column_type(stmt, 0) != SQLITE_NULL;
+    pv.expected = (uint64_t)sqlite3_column_int64(stmt, 0);
+    int64_t algo_id = sqlite3_column_int64(stmt, 1);
 
     sqlite3_finalize(stmt);
 
-    if (stored_checksum.empty()) {
+    if (!has_checksum) {
         // Weird, but fail-open
-        verified_ok_fds.insert(fd);
-        return true;
+        st.verdict = VERIFIED_OK;
+        return VERIFY_PASSED;
     }
 
-    // 2. Compute current checksum from the backing file
-    std::string real = full_path(path);
-    std::string current = compute_checksum_for_file(real);
+    // 2. The current checksum must be computed with the stored algorithm
+    if (!checksum_from_id(algo_id, pv.algo)) {
+        LOGE("verify_fd_checksum: unknown checksum algorithm " << algo_id
+             << " for " << path);
+        st.verdict = VERIFIED_BAD;
+        return VERIFY_FAILED;
+    }
 
-    if (current.empty()) {
-        // Could not compute; conservative choice: treat as bad
-        std::cerr << "verify_fd_checksum: empty current checksum for "
-                  << path << std::endl;
-        verified_bad_fds.insert(fd);
-        return false;
+    // 3. Same file, unchanged since an earlier open verified it?
+    pv.have_stat = fstat(st.fd, &pv.before) == 0;
+    if (pv.have_stat && verify_cache_hit(pv.before, pv.expected, pv.algo)) {
+        st.verdict = VERIFIED_OK;
+        return VERIFY_PASSED;
     }
+    return VERIFY_NEEDS_HASH;
+}
 
-    if (current == stored_checksum) {
-        std::cout << "verify_fd_checksum: OK for " << path
-                  << " (checksum " << current << ")\n";
-        verified_ok_fds.insert(fd);
+// Record the outcome of a completed hash pass (`current`) for fd.
+static bool finish_verification(const char* path, Handle& st,
+                                const PendingVerify& pv, uint64_t current) {
+    if (current == pv.expected) {
+        LOGD("verify_fd_checksum: OK for " << path
+             << " (checksum " << hex64(current) << ")");
+        st.verdict = VERIFIED_OK;
+
+        // Only remember it if nothing changed the file while it was being hashed
+        struct stat after;
+        if (pv.have_stat && fstat(st.fd, &after) == 0 && fingerprint_of(after) == fingerprint_of(pv.before)) {
+            verify_cache_put(after, pv.expected, pv.algo);
+        }
         return true;
     } else {
-        std::cerr << "verify_fd_checksum: MISMATCH for " << path
-                  << " stored=" << stored_checksum
-                  << " current=" << current << std::endl;
-        verified_bad_fds.insert(fd);
+        LOGE("verify_fd_checksum: MISMATCH for " << path
+             << " stored=" << hex64(pv.expected)
+             << " current=" << hex64(current));
+        st.verdict = VERIFIED_BAD;
+        // Pages and attributes cached while the file was being read must not outlive this
+        kernel_invalidate(path);
         return false;
     }
 }
 
-static int fs_init_db() {
-    std::string db_path = full_path("/.metadata.db");  // lives in backing_root
-    std::cout << "Opening metadata DB at: " << db_path << std::endl;
+// Verify checksum for (path, handle) once. Result is kept in st.verdict.
+// Caller holds the file lock.
+static bool verify_fd_checksum(const char* path, Handle& st) {
+    PendingVerify pv;
+    VerifyStart vs = start_verification(path, st, pv);
+    if (vs != VERIFY_NEEDS_HASH) return vs == VERIFY_PASSED;
 
-    int rc = sqlite3_open(db_path.c_str(), &meta_db);
-    if (rc != SQLITE_OK) {
-        std::cerr << "sqlite3_open failed: " << sqlite3_errmsg(meta_db) << std::endl;
-        return -1;
+    // The handle's own fd: the bytes this reader will be served
+    uint64_t current;
+    if (!hash_fd(st.fd, pv.algo, current)) {
+        // Could not compute; conservative choice: treat as bad
+        LOGE("verify_fd_checksum: could not checksum "
+             << path);
+        st.verdict = VERIFIED_BAD;
+        return false;
+    }
+
+    return finish_verification(path, st, pv, current);
+}
+
+// --- STREAMING VERIFICATION ---
+// verify=stream reads of an unverified handle. Caller holds the file lock.
+static int read_streaming(const char* path, Handle& st,
+                          char* buf, size_t size, off_t offset) {
+    int fd = st.fd;
+    // A read from offset 0 of an unsettled fd starts a stream
+    if (!st.streaming && offset == 0) {
+        PendingVerify pv;
+        VerifyStart vs = start_verification(path, st, pv);
+        if (vs == VERIFY_FAILED) return -EIO;
+        if (vs == VERIFY_NEEDS_HASH) {
+            st.stream = {pv, checksum_init(pv.algo), 0};
+            st.streaming = true;
+        }
+    }
+
+    // Not (or no longer) sequential: hash the file upfront instead
+    if (!st.streaming || (uint64_t)offset != st.stream.next_offset) {
+        st.streaming = false;
+        if (!verify_fd_checksum(path, st)) return -EIO;
+        ssize_t res = pread(fd, buf, size, offset);
+        return res == -1 ? -errno : res;
     }
 
+    ssize_t res = pread(fd, buf, size, offset);
+    if (res == -1) return -errno;
+
+    StreamVerify& sv = st.stream;
+    checksum_update(sv.pv.algo, sv.state, buf, (size_t)res);
+    sv.next_offset += res;
+
+    // Reached EOF (as of the start of the stream): the hash is complete
+    if (res == 0 || (sv.pv.have_stat && sv.next_offset >= (uint64_t)sv.pv.before.st_size)) {
+        st.streaming = false;
+        if (!finish_verification(path, st, sv.pv, sv.state)) return -EIO;
+    }
+    return res;
+}
+
+// --- BACKGROUND SCRUB ---
+// With -o scrub=on, a thread re-hashes every file that has a stored checksum,
+// paced by scrub.h. A file that matches is put in the verification cache, so
+// its next open neither hashes it nor drops the kernel's pages, and its row
+// gets verified_at. A mismatch is checked again under the file lock and, if
+// the file is still the one that was hashed and nobody has it open for
+// writing, the file is quarantined. Readers already holding it get EIO.
+
+static const int SCRUB_PAGE = 64;
+
+struct ScrubRow {
+    std::string path;
+    uint64_t checksum;
+    ChecksumAlgo algo;
+};
+
+// Up to SCRUB_PAGE checksummed paths after `after`, in path order
+static bool scrub_next_page(sqlite3* db, const std::string& after, std::vector<ScrubRow>& rows) {
+    rows.clear();
     const char* sql =
+        "SELECT path, checksum, algo FROM checksums "
+        "WHERE path > ? AND checksum IS NOT NULL ORDER BY path LIMIT ?;";
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        LOGE("scrub: prepare failed: " << sqlite3_errmsg(db));
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, after.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, SCRUB_PAGE);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        ScrubRow row;
+        row.path = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        row.checksum = (uint64_t)sqlite3_column_int64(stmt, 1);
+        if (!checksum_from_id(sqlite3_column_int64(stmt, 2), row.algo)) {
+            LOGW("scrub: unknown checksum algorithm for " << row.path);
+            continue;
+        }
+        rows.push_back(std::move(row));
+    }
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+// Is `path` open for writing? Its stored checksum may lag its data then.
+// Caller holds the file lock.
+static bool has_open_writer(const char* path) {
+    size_t path_id = path_id_of(path);
+    OpenShard& sh = open_shard(path_id);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    for (Handle* h = sh.head; h; h = h->next) {
+        if (h->writer && h->path_id == path_id && h->path == path) return true;
+    }
+    return false;
+}
+
+// Stored checksum of `path` unchanged since the page was read?
+static bool scrub_row_current(sqlite3* db, const ScrubRow& row) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT checksum, algo FROM checksums WHERE path = ?;",
+                           -1, &stmt, nullptr) != SQLITE_OK) {
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, row.path.c_str(), -1, SQLITE_TRANSIENT);
+    bool same = sqlite3_step(stmt) == SQLITE_ROW &&
+                (uint64_t)sqlite3_column_int64(stmt, 0) == row.checksum &&
+                sqlite3_column_int64(stmt, 1) == row.algo;
+    sqlite3_finalize(stmt);
+    return same;
+}
+
+static void scrub_mark_verified(sqlite3* db, const ScrubRow& row) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db,
+            "UPDATE checksums SET verified_at = ? WHERE path = ? AND checksum = ?;",
+            -1, &stmt, nullptr) != SQLITE_OK) {
+        return;
+    }
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)time(nullptr));
+    sqlite3_bind_text(stmt, 2, row.path.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)row.checksum);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+}
+
+// Move a file that failed its scrub out of the way. `hashed` is its stat when
+// the hash was taken; nothing happens if the file changed since.
+static void scrub_quarantine(sqlite3* db, const ScrubRow& row, const struct stat& hashed,
+                             uint64_t current) {
+    const char* path = row.path.c_str();
+    std::lock_guard<std::mutex> lock(file_lock(path));
+
+    AtPath at;
+    struct stat now;
+    if (at_path(path, at) != 0 || fstatat(at.fd(), at.name, &now, AT_SYMLINK_NOFOLLOW) == -1 ||
+        !(fingerprint_of(now) == fingerprint_of(hashed)) || now.st_dev != hashed.st_dev ||
+        has_open_writer(path) || !scrub_row_current(db, row)) {
+        LOGD("scrub: " << path << " changed while it was checked; skipped");
+        return;
+    }
+
+    LOGE("scrub: MISMATCH for " << path << " stored=" << hex64(row.checksum)
+         << " current=" << hex64(current));
+
+    // Readers that already passed verification must not see any more of it
+    {
+        size_t path_id = path_id_of(path);
+        OpenShard& sh = open_shard(path_id);
+        std::lock_guard<std::mutex> shard_lock(sh.mtx);
+        for (Handle* h = sh.head; h; h = h->next) {
+            if (h->path_id == path_id && h->path == path) h->verdict = VERIFIED_BAD;
+        }
+    }
+    verify_cache_erase(now);
+
+    std::string moved = quarantine_move(path);
+    if (moved.empty()) return;
+
+    // The rows follow the file, as in fs_rename
+    for (const char* sql : {"UPDATE metadata SET path = ? WHERE path = ?;",
+                            "UPDATE checksums SET path = ? WHERE path = ?;"}) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, moved.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(stmt, 2, path, -1, SQLITE_TRANSIENT);
+            sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+    }
+    quarantine_record(db, path, moved, std::string("checksum mismatch: stored=") +
+                      hex64(row.checksum) + " current=" + hex64(current) +
+                      " (" + checksum_name(row.algo) + ")");
+    LOGE("scrub: quarantined " << path << " as " << moved);
+
+    kernel_invalidate(path);
+    kernel_invalidate(QUARANTINE_DIR);
+}
+
+// Hash and judge one file
+static void scrub_file(sqlite3* db, const ScrubRow& row, ScrubThrottle& throttle) {
+    const char* path = row.path.c_str();
+    AtPath at;
+    if (at_path(path, at) != 0) return;
+    int fd = openat(at.fd(), at.name, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) return;  // gone or not a file; unlink/rename own its row
+
+    struct stat before, after;
+    uint64_t current = checksum_init(row.algo);
+    int rc = fstat(fd, &before) == 0 && S_ISREG(before.st_mode)
+           ? scrub_read_file(fd, throttle, [&](const char* data, size_t len) {
+                 checksum_update(row.algo, current, data, len);
+             })
+           : -EINVAL;
+    bool same = rc == 0 && fstat(fd, &after) == 0 &&
+                fingerprint_of(after) == fingerprint_of(before);
+    close(fd);
+    // Written to while it was read: the next pass will see it settled
+    if (!same) return;
+
+    if (current == row.checksum) {
+        verify_cache_put(after, row.checksum, row.algo);
+        scrub_mark_verified(db, row);
+        return;
+    }
+    scrub_quarantine(db, row, after, current);
+}
+
+static void scrub_pass() {
+    sqlite3* db = thread_db();
+    if (!db) return;
+
+    LOGI("scrub: pass started");
+    ScrubThrottle throttle;
+    std::vector<ScrubRow> rows;
+    std::string after;
+    size_t files = 0;
+    while (!scrub_stopping() && scrub_next_page(db, after, rows) && !rows.empty()) {
+        for (const ScrubRow& row : rows) {
+            if (scrub_stopping()) break;
+            if (is_quarantine_path(row.path)) continue;
+            scrub_file(db, row, throttle);
+            ++files;
+        }
+        after = rows.back().path;
+    }
+    LOGI("scrub: pass " << (scrub_stopping() ? "interrupted" : "finished")
+         << " after " << files << " files");
+}
+
+static int init_schema(sqlite3* db) {
+    std::string sql =
         "CREATE TABLE IF NOT EXISTS metadata ("
         "  path TEXT NOT NULL,"
         "  key  TEXT NOT NULL,"
         "  value BLOB,"
         "  PRIMARY KEY(path, key)"
-        ");"
-        "CREATE TABLE IF NOT EXISTS checksums ("
-        "  path TEXT PRIMARY KEY,"
-        "  checksum TEXT"
         ");";
+    sql += QUARANTINE_SQL;
 
     char* errmsg = nullptr;
-    rc = sqlite3_exec(meta_db, sql, nullptr, nullptr, &errmsg);
+    int rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
     if (rc != SQLITE_OK) {
-        std::cerr << "sqlite3_exec failed: " << errmsg << std::endl;
+        LOGE("sqlite3_exec failed: " << errmsg);
         sqlite3_free(errmsg);
         return -1;
     }
 
+    return create_checksums_schema(db);
+}
+
+// Set up the schema on a connection of its own; FUSE threads open theirs afterwards.
+static int fs_init_db() {
+    db_path = full_path("/.metadata.db");  // lives in backing_root
+    LOGI("Opening metadata DB at: " << db_path);
+
+    sqlite3* db = open_db_connection();
+    if (!db) {
+        return -1;
+    }
+    int rc = init_schema(db);
+    close_db_connection(db);
+    if (rc != 0) {
+        return -1;
+    }
+
+    db_ready = true;
     return 0;
 }
 
-static void* fs_init(struct fuse_conn_info* conn) {
-    (void) conn;
+static void* fs_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    log_start();
+    negotiate_fuse_conn(conn, cfg);
+    kernel_inval_start();
     if (fs_init_db() != 0) {
-        std::cerr << "Failed to init metadata DB" << std::endl;
+        LOGE("Failed to init metadata DB");
+    } else {
+        scrub_start(scrub_pass);
     }
     return nullptr;
 }
 
 static void fs_destroy(void* private_data) {
     (void) private_data;
-    if (meta_db) {
-        std::cout << "Closing metadata DB" << std::endl;
-        sqlite3_close(meta_db);
-        meta_db = nullptr;
-    }
+    scrub_stop();
+    db_ready = false;
+    std::lock_guard<std::mutex> lock(db_conns_mutex);
+    if (!db_conns.empty()) {
+        LOGI("Closing metadata DB");
+    }
+    for (sqlite3* db : db_conns) {
+        sqlite3_close(db);
+    }
+    db_conns.clear();
+    kernel_inval_stop();
+    backing_close_root();
+    log_stop();
 }
 
 static int fs_listxattr(const char* path, char* list, size_t size) {
-    if (!meta_db) return -EIO;
+    sqlite3* db = thread_db();
+    if (!db) return -EIO;
 
-    std::cout << "fs_listxattr: " << path << std::endl;
+    LOGD("fs_listxattr: " << path);
 
     const char* sql = "SELECT key FROM metadata WHERE path = ?;";
     sqlite3_stmt* stmt = nullptr;
 
-    int rc = sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr);
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "fs_listxattr: prepare failed: "
-                  << sqlite3_errmsg(meta_db) << std::endl;
+        LOGE("fs_listxattr: prepare failed: "
+             << sqlite3_errmsg(db));
         return -EIO;
     }
 
@@ -283,7 +996,7 @@ static int fs_listxattr(const char* path, char* list, size_t size) {
     sqlite3_finalize(stmt);
 
     if (rc != SQLITE_DONE) {
-        std::cerr << "fs_listxattr: step failed\n";
+        LOGE("fs_listxattr: step failed");
         return -EIO;
     }
 
@@ -310,13 +1023,19 @@ static int fs_listxattr(const char* path, char* list, size_t size) {
 /*
  * fs_getattr: pass-through "stat"
  */
-static int fs_getattr(const char* path, struct stat* st) {
+static int fs_getattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
     memset(st, 0, sizeof(struct stat));
+    LOGD("fs_getattr: " << path);
 
-    std::string real = full_path(path);
-    std::cout << "fs_getattr: " << path << " -> " << real << std::endl;
+    // fgetattr: the open handle already names the file (directories have no handle)
+    if (fi && fi->fh) {
+        if (fstat(handle_of(fi)->fd, st) == -1) return -errno;
+        return 0;
+    }
 
-    if (lstat(real.c_str(), st) == -1) {
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (fstatat(at.fd(), at.name, st, AT_SYMLINK_NOFOLLOW) == -1) {
         return -errno;   // map OS errno to FUSE error
     }
     return 0;
@@ -326,21 +1045,32 @@ static int fs_getattr(const char* path, struct stat* st) {
  * fs_readdir: pass-through "ls"
  */
 static int fs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
-                      off_t offset, struct fuse_file_info* fi) {
+                      off_t offset, struct fuse_file_info* fi,
+                      enum fuse_readdir_flags flags) {
     (void) offset;
     (void) fi;
 
-    std::string real = full_path(path);
-    std::cout << "fs_readdir: " << path << " -> " << real << std::endl;
+    LOGD("fs_readdir: " << path);
 
-    DIR* dp = opendir(real.c_str());
-    if (dp == nullptr) {
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    int dfd = openat(at.fd(), at.name, O_RDONLY | O_DIRECTORY);
+    if (dfd == -1) {
         return -errno;
     }
+    DIR* dp = fdopendir(dfd);
+    if (dp == nullptr) {
+        int err = errno;
+        close(dfd);
+        return -err;
+    }
 
     // Every directory must have "." and ".."
-    filler(buf, ".",  nullptr, 0);
-    filler(buf, "..", nullptr, 0);
+    filler(buf, ".",  nullptr, 0, (fuse_fill_dir_flags)0);
+    filler(buf, "..", nullptr, 0, (fuse_fill_dir_flags)0);
+
+    // readdirplus: hand the attributes over with the names, saving a lookup per entry
+    bool plus = flags & FUSE_READDIR_PLUS;
 
     struct dirent* de;
     while ((de = readdir(dp)) != nullptr) {
@@ -350,7 +1080,10 @@ static int fs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
             continue;
         }
 
-        if (filler(buf, name, nullptr, 0) != 0) {
+        struct stat st;
+        bool have_st = plus && fstatat(dirfd(dp), name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+        if (filler(buf, name, have_st ? &st : nullptr, 0,
+                   have_st ? FUSE_FILL_DIR_PLUS : (fuse_fill_dir_flags)0) != 0) {
             closedir(dp);
             return -ENOMEM;
         }
@@ -361,22 +1094,15 @@ static int fs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
 }
 
 
-static uint64_t compute_hash_uint64(const std::string& real_path) {
-    int fd = open(real_path.c_str(), O_RDONLY);
-    if (fd == -1) {
-        // If file can't be opened, return default empty hash
-        return FNV_OFFSET_BASIS;
-    }
-
-    uint64_t hash = FNV_OFFSET_BASIS;
-    char buf[4096];
-    ssize_t n;
-
-    while ((n = read(fd, buf, sizeof(buf))) > 0) {
-        update_fnv1a(hash, buf, (size_t)n);
+// Hash the whole file; `length` (optional) receives the number of bytes hashed.
+static uint64_t compute_hash_uint64(const char* path, ChecksumAlgo algo,
+                                    uint64_t* length = nullptr) {
+    uint64_t hash;
+    if (!compute_checksum_for_file(path, algo, hash, length)) {
+        // If file can't be read, return default empty hash
+        if (length) *length = 0;
+        return checksum_init(algo);
     }
-
-    close(fd);
     return hash;
 }
 
@@ -385,73 +1111,121 @@ static uint64_t compute_hash_uint64(const std::string& real_path) {
  */
 static int fs_open(const char* path, struct fuse_file_info* fi) {
     if (is_append_only_path(path) && (fi->flags & O_TRUNC)) {
-        std::cout << "fs_open: DENY O_TRUNC (append-only) " << path << std::endl;
+        LOGW("fs_open: DENY O_TRUNC (append-only) " << path);
         return -EPERM;
     }
 
-    std::string real = full_path(path);
-    std::cout << "fs_open: " << path << " -> " << real << std::endl;
+    LOGD("fs_open: " << path);
+
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+
+    // Ordered against writes, truncates and hash passes on the same file
+    std::lock_guard<std::mutex> lock(file_lock(path));
 
     // 1. Open the real file
-    int fd = open(real.c_str(), fi->flags);
+    int fd = openat(at.fd(), at.name, backing_open_flags(fi->flags));
     if (fd == -1) return -errno;
 
-    fi->fh = fd; 
-    verified_ok_fds.erase(fd);
-    verified_bad_fds.erase(fd);
-
     int accmode = fi->flags & O_ACCMODE;
     bool is_writer = (accmode == O_WRONLY || accmode == O_RDWR);
 
     if (is_writer) {
+        verify_cache_erase_fd(fd);
+
         if (fi->flags & O_TRUNC) {
             // Overwrite: Old data irrelevant. Start fresh.
-            checksum_map[fd] = FNV_OFFSET_BASIS;
+            Handle* h = handle_open(fd, path, true);
+            h->hash = {checksum_init(checksum_algo), checksum_algo, 0};
+            fi->fh = reinterpret_cast<uintptr_t>(h);
         } else {
             // STRICT APPEND LOGIC
             
-            // 1. Compute hash of what is currently on disk
-            uint64_t disk_hash_val = compute_hash_uint64(real);
-            
-            // 2. Fetch what the DB thinks the hash should be
-            if (meta_db) {
-                const char* sql = "SELECT checksum FROM checksums WHERE path = ?;";
+            // 1. Fetch what the DB thinks the hash should be (and which algorithm made it)
+            bool have_db_hash = false;
+            bool have_fp = false;
+            uint64_t db_hash = 0;
+            int64_t algo_id = checksum_algo;
+            FileFingerprint db_fp = {};
+            if (sqlite3* db = thread_db()) {
+                const char* sql =
+                    "SELECT checksum, algo, size, mtime_ns, ctime_ns, ino "
+                    "FROM checksums WHERE path = ?;";
                 sqlite3_stmt* stmt = nullptr;
-                if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+                if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
                     sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
                     
                     int rc = sqlite3_step(stmt);
-                    if (rc == SQLITE_ROW) {
-                        const unsigned char* txt = sqlite3_column_text(stmt, 0);
-                        std::string db_hash = txt ? reinterpret_cast<const char*>(txt) : "";
-                        
-                        // Convert our disk calculation to string for comparison
-                        std::ostringstream oss;
-                        oss << std::hex << disk_hash_val;
-                        std::string disk_hash_str = oss.str();
-
-                        // 3. STRICT CHECK
-                        if (!db_hash.empty() && db_hash != disk_hash_str) {
-                            std::cerr << "fs_open: STRICT INTEGRITY CHECK FAILED on Append!" << std::endl;
-                            std::cerr << "   DB Says:   " << db_hash << std::endl;
-                            std::cerr << "   Disk Says: " << disk_hash_str << std::endl;
-                            
-                            sqlite3_finalize(stmt);
-                            close(fd); // Close the file we just opened
-                            return -EIO; // BLOCK THE OPEN
+                    if (rc == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+                        db_hash = (uint64_t)sqlite3_column_int64(stmt, 0);
+                        algo_id = sqlite3_column_int64(stmt, 1);
+                        have_db_hash = true;
+                        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+                            db_fp = {sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3),
+                                     sqlite3_column_int64(stmt, 4), sqlite3_column_int64(stmt, 5)};
+                            have_fp = true;
                         }
                     }
                     sqlite3_finalize(stmt);
                 }
             }
 
+            // An existing file keeps the algorithm it was sealed with until it is rewritten
+            ChecksumAlgo algo;
+            if (!checksum_from_id(algo_id, algo)) {
+                LOGE("fs_open: unknown checksum algorithm " << algo_id
+                     << " for " << path);
+                close(fd);
+                return -EIO;
+            }
+
+            // 2. Unchanged since the checksum was stored? Resume from it in O(1).
+            struct stat st;
+            if (have_fp && fstat(fd, &st) == 0 && fingerprint_of(st) == db_fp) {
+                Handle* h = handle_open(fd, path, true);
+                h->hash = {db_hash, algo, (uint64_t)db_fp.size};
+                fi->fh = reinterpret_cast<uintptr_t>(h);
+                LOGD("fs_open: Fingerprint unchanged. Resumed hash for append.");
+                return 0;
+            }
+
+            // 3. Otherwise compute hash of what is currently on disk
+            uint64_t disk_len = 0;
+            uint64_t disk_hash_val = compute_hash_uint64(path, algo, &disk_len);
+
+            // 4. STRICT CHECK
+            if (have_db_hash && db_hash != disk_hash_val) {
+                LOGE("fs_open: STRICT INTEGRITY CHECK FAILED on Append!");
+                LOGE("   DB Says:   " << hex64(db_hash));
+                LOGE("   Disk Says: " << hex64(disk_hash_val));
+                
+                close(fd); // Close the file we just opened
+                return -EIO; // BLOCK THE OPEN
+            }
+
             // Check passed (or DB was empty). Load the hash and proceed.
-            checksum_map[fd] = disk_hash_val;
-            std::cout << "fs_open: Integrity verified. Pre-loaded hash for append." << std::endl;
+            Handle* h = handle_open(fd, path, true);
+            h->hash = {disk_hash_val, algo, disk_len};
+            fi->fh = reinterpret_cast<uintptr_t>(h);
+            LOGD("fs_open: Integrity verified. Pre-loaded hash for append.");
+        }
+    } else {
+        fi->fh = reinterpret_cast<uintptr_t>(handle_open(fd, path, false));
+
+        // Keep the kernel's pages only for a file verified in its current state.
+        // Otherwise the kernel drops them now, and every read comes back through
+        // fs_read to be verified.
+        struct stat st;
+        bool changed = false;
+        fi->keep_cache = fstat(fd, &st) == 0 && verify_cache_fresh(st, &changed);
+        if (changed) {
+            // Modified outside the mount: other open handles and the attribute cache hold old data too
+            LOGI("fs_open: " << path << " changed since it was verified");
+            kernel_invalidate(path);
         }
+        LOGD("fs_open: keep_cache=" << fi->keep_cache << " for " << path);
     }
 
-    open_path_to_fd.insert({std::string(path), fd});
     return 0;
 }
 
@@ -460,16 +1234,26 @@ static int fs_open(const char* path, struct fuse_file_info* fi) {
  */
 static int fs_read(const char* path, char* buf, size_t size,
                    off_t offset, struct fuse_file_info* fi) {
-    int fd = static_cast<int>(fi->fh);
+    Handle* h = handle_of(fi);
 
-    // If this fd is NOT being tracked as a writer, enforce checksum verification
-    if (checksum_map.find(fd) == checksum_map.end()) {
-        if (!verify_fd_checksum(path, fd)) {
+    // If this handle is NOT a writer, enforce checksum verification
+    if (!h->writer) {
+        int verdict = h->verdict;
+        if (verdict == VERIFIED_BAD) {
             return -EIO;
         }
+        if (verdict == UNVERIFIED) {
+            HandleLock lock(h);
+            if (verify_mode == VERIFY_STREAM) {
+                return read_streaming(path, *h, buf, size, offset);
+            }
+            if (!verify_fd_checksum(path, *h)) {
+                return -EIO;
+            }
+        }
     }
 
-    ssize_t res = pread(fd, buf, size, offset);
+    ssize_t res = pread(h->fd, buf, size, offset);
     if (res == -1) {
         return -errno;
     }
@@ -477,25 +1261,178 @@ static int fs_read(const char* path, char* buf, size_t size,
 }
 
 
+// Does a write at `offset` extend h's running hash? Caller holds the file lock.
+static bool extends_running_hash(const Handle* h, off_t offset) {
+    return h->writer && !h->hash_stale && (uint64_t)offset == h->hash.length;
+}
+
+// Hash and write one buffer. Caller holds the file lock.
+static int write_locked(Handle* h, const char* buf, size_t size, off_t offset) {
+    // The running hash only extends a sequential stream. Anything else (random
+    // writes, or the writeback cache flushing pages out of order) leaves it
+    // stale, and release rehashes the file instead.
+    if (extends_running_hash(h, offset)) {
+        checksum_update(h->hash.algo, h->hash.state, buf, size);
+        h->hash.length += size;
+    } else if (h->writer) {
+        h->hash_stale = true;
+    }
+    writers_mark_stale(h);
+
+    ssize_t res = pwrite(h->fd, buf, size, offset);
+    if (res == -1) {
+        return -errno;
+    }
+    return res;
+}
+
 /*
  * fs_write: write to an already-open file
  */
 static int fs_write(const char* path, const char* buf, size_t size,
                     off_t offset, struct fuse_file_info* fi) {
     (void) path;
+    Handle* h = handle_of(fi);
+
+    // Per-file ordering: the running hash must see writes in the order they hit disk
+    HandleLock lock(h);
+    return write_locked(h, buf, size, offset);
+}
+
+// --- ZERO-COPY READ/WRITE ---
+// read_buf/write_buf let libfuse move data between /dev/fuse and the backing
+// file with splice(2) instead of copying it through our buffers. That is only
+// possible where no hash has to see the bytes:
+//   - reads of verified files and of writer handles go fd to fd;
+//   - reads still under a verify=stream pass are served from memory;
+//   - writes that extend a live running hash are gathered into memory once,
+//     hashed and written; all other writes go fd to fd, and the release
+//     rehash covers them.
+
+// One-buffer bufvec for libfuse, which frees it (and `mem`) after replying
+static struct fuse_bufvec* new_bufvec(size_t size) {
+    struct fuse_bufvec* bv = static_cast<struct fuse_bufvec*>(malloc(sizeof(*bv)));
+    if (!bv) return nullptr;
+    memset(bv, 0, sizeof(*bv));
+    bv->count = 1;
+    bv->buf[0].size = size;
+    bv->buf[0].fd = -1;
+    return bv;
+}
 
-    int fd = static_cast<int>(fi->fh);
+/*
+ * fs_read_buf: read, handing libfuse the backing fd where possible
+ */
+static int fs_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size,
+                       off_t offset, struct fuse_file_info* fi) {
+    Handle* h = handle_of(fi);
+
+    if (!h->writer && h->verdict != VERIFIED_OK) {
+        if (h->verdict == UNVERIFIED && verify_mode == VERIFY_STREAM) {
+            // The stream hash has to see the bytes: read them into memory
+            struct fuse_bufvec* bv = new_bufvec(size);
+            void* mem = malloc(size);
+            if (!bv || !mem) {
+                free(bv);
+                free(mem);
+                return -ENOMEM;
+            }
+            int res = fs_read(path, static_cast<char*>(mem), size, offset, fi);
+            if (res < 0) {
+                free(bv);
+                free(mem);
+                return res;
+            }
+            bv->buf[0].size = res;
+            bv->buf[0].mem = mem;
+            *bufp = bv;
+            return 0;
+        }
 
-    // Update checksum if this fd is tracked
-    auto it = checksum_map.find(fd);
-    if (it != checksum_map.end()) {
-        update_fnv1a(it->second, buf, size);
+        HandleLock lock(h);
+        if (!verify_fd_checksum(path, *h)) {
+            return -EIO;
+        }
     }
 
-    ssize_t res = pwrite(fd, buf, size, offset);
+    struct fuse_bufvec* bv = new_bufvec(size);
+    if (!bv) return -ENOMEM;
+    bv->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    bv->buf[0].fd = h->fd;
+    bv->buf[0].pos = offset;
+    *bufp = bv;
+    return 0;
+}
+
+/*
+ * fs_write_buf: write, splicing into the backing fd where no hash needs the bytes
+ */
+static int fs_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset,
+                        struct fuse_file_info* fi) {
+    (void) path;
+    Handle* h = handle_of(fi);
+    size_t size = fuse_buf_size(buf);
+
+    HandleLock lock(h);
+
+    if (extends_running_hash(h, offset)) {
+        // Already in memory (the usual case): hash and write it in place
+        if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+            return write_locked(h, static_cast<const char*>(buf->buf[0].mem), size, offset);
+        }
+
+        static thread_local std::vector<char> scratch;
+        if (scratch.size() < size) scratch.resize(size);
+        struct fuse_bufvec mem = {};
+        mem.count = 1;
+        mem.buf[0].size = size;
+        mem.buf[0].mem = scratch.data();
+        mem.buf[0].fd = -1;
+        ssize_t got = fuse_buf_copy(&mem, buf, static_cast<fuse_buf_copy_flags>(0));
+        if (got < 0) return (int)got;
+        return write_locked(h, scratch.data(), got, offset);
+    }
+
+    if (h->writer) h->hash_stale = true;
+    writers_mark_stale(h);
+
+    struct fuse_bufvec dst = {};
+    dst.count = 1;
+    dst.buf[0].size = size;
+    dst.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    dst.buf[0].fd = h->fd;
+    dst.buf[0].pos = offset;
+    return (int)fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+/*
+ * fs_copy_file_range: copy between two open files inside the backing fs
+ */
+static ssize_t fs_copy_file_range(const char* path_in, struct fuse_file_info* fi_in,
+                                  off_t off_in, const char* path_out,
+                                  struct fuse_file_info* fi_out, off_t off_out,
+                                  size_t len, int flags) {
+    Handle* in = handle_of(fi_in);
+    Handle* out = handle_of(fi_out);
+    LOGD("fs_copy_file_range: " << path_in << " -> " << path_out << " len=" << len);
+
+    // The source is read like any other file: it has to verify first
+    if (!in->writer && in->verdict != VERIFIED_OK) {
+        HandleLock lock(in);
+        if (!verify_fd_checksum(path_in, *in)) {
+            return -EIO;
+        }
+    }
+
+    HandleLock lock(out);
+    ssize_t res = copy_file_range(in->fd, &off_in, out->fd, &off_out, len, flags);
     if (res == -1) {
         return -errno;
     }
+
+    // The copied bytes never pass through fs_write
+    if (out->writer) out->hash_stale = true;
+    writers_mark_stale(out);
     return res;
 }
 
@@ -503,36 +1440,50 @@ static int fs_write(const char* path, const char* buf, size_t size,
  * fs_release: close the file when FUSE is done
  */
 static int fs_release(const char* path, struct fuse_file_info* fi) {
-    int fd = static_cast<int>(fi->fh);
-
-    auto range = open_path_to_fd.equal_range(path);
-    for (auto it = range.first; it != range.second; ) {
-        if (it->second == fd) {
-            it = open_path_to_fd.erase(it);
-        } else {
-            ++it;
+    Handle* h = handle_of(fi);
+    int fd = h->fd;
+
+    HandleLock lock(h);
+    bool writer = h->writer;
+    RunningHash hash = h->hash;
+
+    // A running hash that does not cover exactly the bytes on disk (a size
+    // change it never saw) describes some other file: rehash what is there.
+    struct stat st;
+    bool have_st = writer && fstat(fd, &st) == 0;
+    if (writer && (h->hash_stale || !have_st || (uint64_t)st.st_size != hash.length)) {
+        hash.algo = checksum_algo;
+        hash.state = compute_hash_uint64(path, hash.algo, &hash.length);
+        have_st = fstat(fd, &st) == 0;
+    }
+
+    // Fingerprint the file as this writer leaves it. Only if the hash covers
+    // exactly the bytes on disk can a later append resume from it.
+    FileFingerprint fp;
+    bool have_fp = false;
+    if (have_st) {
+        // The content changed through this fd: forget any earlier verification
+        verify_cache_erase(st);
+        if ((uint64_t)st.st_size == hash.length) {
+            fp = fingerprint_of(st);
+            have_fp = true;
         }
     }
 
+    handle_close(h);
+
     // Close underlying file
     int res = (close(fd) == -1) ? -errno : 0;
 
     // If we tracked a checksum for this fd, finalize & store it
-    auto it = checksum_map.find(fd);
-    if (it != checksum_map.end()) {
-        uint64_t hash = it->second;
-        checksum_map.erase(it);
-
-        int rc = store_checksum(path, hash);
+    if (writer) {
+        int rc = store_checksum(path, hash.state, hash.algo, have_fp ? &fp : nullptr);
         if (rc != 0) {
-            std::cerr << "fs_release: failed to store checksum for "
-                      << path << std::endl;
+            LOGE("fs_release: failed to store checksum for "
+                 << path);
         }
     }
 
-    verified_ok_fds.erase(fd);
-    verified_bad_fds.erase(fd);
-
     return res;
 }
 
@@ -540,22 +1491,26 @@ static int fs_release(const char* path, struct fuse_file_info* fi) {
  * fs_create: create a new file
  */
 static int fs_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
-    std::string real = full_path(path);
-    std::cout << "fs_create: " << path << " -> " << real << std::endl;
+    LOGD("fs_create: " << path);
 
-    int fd = open(real.c_str(), fi->flags, mode);
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+
+    std::lock_guard<std::mutex> lock(file_lock(path));
+
+    int fd = openat(at.fd(), at.name, backing_open_flags(fi->flags), mode);
     if (fd == -1) {
         return -errno;
     }
 
-    fi->fh = fd;
-
     int accmode = fi->flags & O_ACCMODE;
     bool is_writer = (accmode == O_WRONLY || accmode == O_RDWR);
 
+    Handle* h = handle_open(fd, path, is_writer);
     if (is_writer) {
-        checksum_map[fd] = FNV_OFFSET_BASIS;
+        h->hash = {checksum_init(checksum_algo), checksum_algo, 0};
     }
+    fi->fh = reinterpret_cast<uintptr_t>(h);
 
     return 0;
 }
@@ -578,10 +1533,17 @@ static bool is_append_only_path(const char* path) {
     return false;
 }
 
-static int fs_utimens(const char* path, const struct timespec tv[2]) {
-    std::string real = full_path(path);
+static int fs_utimens(const char* path, const struct timespec tv[2],
+                      struct fuse_file_info* fi) {
+    if (fi && fi->fh) {
+        if (futimens(handle_of(fi)->fd, tv) == -1) return -errno;
+        return 0;
+    }
+
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
     // utimensat with 0 flags updates the time on the real underlying file
-    if (utimensat(0, real.c_str(), tv, 0) == -1) {
+    if (utimensat(at.fd(), at.name, tv, 0) == -1) {
         return -errno;
     }
     return 0;
@@ -592,30 +1554,35 @@ static int fs_utimens(const char* path, const struct timespec tv[2]) {
  */
 static int fs_unlink(const char* path) {
     if (is_append_only_path(path)) {
-        std::cout << "fs_unlink: DENY (append-only) " << path << std::endl;
+        LOGW("fs_unlink: DENY (append-only) " << path);
         return -EPERM;
     }
 
-    std::string real = full_path(path);
-    std::cout << "fs_unlink: " << path << " -> " << real << std::endl;
+    LOGD("fs_unlink: " << path);
+
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+
+    std::lock_guard<std::mutex> lock(file_lock(path));
 
-    if (unlink(real.c_str()) == -1) {
+    verify_cache_erase_at(at);
+    if (unlinkat(at.fd(), at.name, 0) == -1) {
         return -errno;
     }
 
-    if (meta_db) {
+    if (sqlite3* db = thread_db()) {
         const char* sql1 = "DELETE FROM metadata WHERE path = ?;";
         const char* sql2 = "DELETE FROM checksums WHERE path = ?;";
 
         sqlite3_stmt* stmt = nullptr;
 
-        if (sqlite3_prepare_v2(meta_db, sql1, -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_prepare_v2(db, sql1, -1, &stmt, nullptr) == SQLITE_OK) {
             sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
             sqlite3_step(stmt);
             sqlite3_finalize(stmt);
         }
 
-        if (sqlite3_prepare_v2(meta_db, sql2, -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_prepare_v2(db, sql2, -1, &stmt, nullptr) == SQLITE_OK) {
             sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
             sqlite3_step(stmt);
             sqlite3_finalize(stmt);
@@ -624,37 +1591,56 @@ static int fs_unlink(const char* path) {
     return 0;
 }
 
-static int fs_truncate(const char* path, off_t size) {
+static int fs_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
     if (is_append_only_path(path)) {
-        std::cout << "fs_truncate: DENY (append-only) " << path << std::endl;
+        LOGW("fs_truncate: DENY (append-only) " << path);
         return -EPERM;
     }
 
-    std::string real = full_path(path);
-    std::cout << "fs_truncate: " << path << " -> " << real
-              << " size=" << size << std::endl;
+    LOGD("fs_truncate: " << path << " size=" << size);
 
-    if (truncate(real.c_str(), size) == -1) {
-        return -errno;
+    std::lock_guard<std::mutex> lock(file_lock(path));
+
+    // ftruncate(2) through the caller's handle, or a fd opened at the cached parent
+    int fd = fi ? handle_of(fi)->fd : -1;
+    if (fd == -1) {
+        AtPath at;
+        if (int rc = at_path(path, at)) return rc;
+        fd = openat(at.fd(), at.name, O_WRONLY);
+        if (fd == -1) return -errno;
+    }
+    int res = ftruncate(fd, size);
+    int err = errno;
+    struct stat st;
+    bool have_st = res == 0 && fstat(fd, &st) == 0;
+    if (!fi) close(fd);
+    if (res == -1) {
+        return -err;
     }
+    if (have_st) verify_cache_erase(st);
 
     // 1. Calculate the NEW hash of the file on disk (handles size=0 or size=N)
-    uint64_t new_hash = compute_hash_uint64(real);
+    // (a full rescan anyway, so the file moves to this mount's algorithm)
+    uint64_t new_len = 0;
+    uint64_t new_hash = compute_hash_uint64(path, checksum_algo, &new_len);
     
     // 2. Update the Database
-    store_checksum(path, new_hash);
-
-    // 3. Update any OPEN file descriptors
-    auto range = open_path_to_fd.equal_range(path);
-    for (auto it = range.first; it != range.second; ++it) {
-        int fd = it->second;
-        
-        // CRITICAL CHECK: Only update if this FD is actually a WRITER.
-        // If we don't check this, we might accidentally add a read-only FD 
-        // to the checksum_map, breaking future reads.
-        if (checksum_map.count(fd)) {
-            checksum_map[fd] = new_hash; 
-            std::cout << "fs_truncate: Updated running hash for FD " << fd << std::endl;
+    FileFingerprint fp;
+    bool have_fp = have_st && (uint64_t)st.st_size == new_len;
+    if (have_fp) fp = fingerprint_of(st);
+    store_checksum(path, new_hash, checksum_algo, have_fp ? &fp : nullptr);
+
+    // 3. Update any OPEN handles of this path
+    size_t path_id = path_id_of(path);
+    OpenShard& sh = open_shard(path_id);
+    std::lock_guard<std::mutex> shard_lock(sh.mtx);
+    for (Handle* h = sh.head; h; h = h->next) {
+        // CRITICAL CHECK: Only update if this handle is actually a WRITER.
+        // Read-only handles have no running hash and keep verifying against the DB.
+        if (h->writer && h->path_id == path_id && h->path == path) {
+            h->hash = {new_hash, checksum_algo, new_len};
+            h->hash_stale = false;
+            LOGD("fs_truncate: Updated running hash for FD " << h->fd);
         }
     }
     return 0;
@@ -665,9 +1651,10 @@ static int fs_setxattr(const char* path, const char* name,
                        const char* value, size_t size, int flags) {
     (void) flags;
 
-    if (!meta_db) return -EIO;
+    sqlite3* db = thread_db();
+    if (!db) return -EIO;
 
-    std::cout << "fs_setxattr: " << path << " [" << name << "]" << std::endl;
+    LOGD("fs_setxattr: " << path << " [" << name << "]");
 
     const char* sql =
         "INSERT INTO metadata(path, key, value) "
@@ -675,7 +1662,7 @@ static int fs_setxattr(const char* path, const char* name,
         "ON CONFLICT(path, key) DO UPDATE SET value = excluded.value;";
 
     sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr);
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
         return -EIO;
     }
@@ -695,15 +1682,16 @@ static int fs_setxattr(const char* path, const char* name,
 
 static int fs_getxattr(const char* path, const char* name,
                        char* value, size_t size) {
-    if (!meta_db) return -EIO;
+    sqlite3* db = thread_db();
+    if (!db) return -EIO;
 
-    std::cout << "fs_getxattr: " << path << " [" << name << "]" << std::endl;
+    LOGD("fs_getxattr: " << path << " [" << name << "]");
 
     const char* sql =
         "SELECT value FROM metadata WHERE path = ? AND key = ?;";
 
     sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr);
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
         return -EIO;
     }
@@ -736,31 +1724,50 @@ static int fs_getxattr(const char* path, const char* name,
     return blob_size;      // number of bytes copied
 }
 
-static int fs_rename(const char* from, const char* to) {
+static int fs_rename(const char* from, const char* to, unsigned int flags) {
+    // RENAME_EXCHANGE would have to swap the two files' rows; not supported
+    if (flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;
+    }
+
     // If either source or destination lives under an append-only dir, block.
     if (is_append_only_path(from) || is_append_only_path(to)) {
-        std::cout << "fs_rename: DENY (append-only) from=" << from
-                  << " to=" << to << std::endl;
+        LOGW("fs_rename: DENY (append-only) from=" << from
+             << " to=" << to);
         return -EPERM;
     }
 
-    std::string real_from = full_path(from);
-    std::string real_to   = full_path(to);
+    LOGD("fs_rename: " << from << " -> " << to);
+
+    AtPath at_from, at_to;
+    if (int rc = at_path(from, at_from)) return rc;
+    if (int rc = at_path(to, at_to)) return rc;
 
-    std::cout << "fs_rename: " << from << " -> " << to
-              << "  (" << real_from << " -> " << real_to << ")\n";
+    RenameLock lock(from, to);
+    // Checked under the lock: a directory needs every stripe for its descendants
+    struct stat st;
+    bool is_dir = fstatat(at_from.fd(), at_from.name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                  S_ISDIR(st.st_mode);
+    if (is_dir) lock.lock_all();
 
-    if (::rename(real_from.c_str(), real_to.c_str()) == -1) {
+    // Both the moved file and any file it replaces lose their cached verification
+    verify_cache_erase_at(at_to);
+    if (renameat2(at_from.fd(), at_from.name, at_to.fd(), at_to.name, flags) == -1) {
         return -errno;
     }
+    verify_cache_erase_at(at_to);
+    handles_rename(from, to, is_dir);
+    // If a directory moved, fds cached for paths under either name are wrong now
+    backing_dir_invalidate(from);
+    backing_dir_invalidate(to);
 
-    if (meta_db) {
+    if (sqlite3* db = thread_db()) {
         // Update metadata table
         const char* sql_meta =
             "UPDATE metadata SET path = ? WHERE path = ?;";
         sqlite3_stmt* stmt = nullptr;
 
-        if (sqlite3_prepare_v2(meta_db, sql_meta, -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_prepare_v2(db, sql_meta, -1, &stmt, nullptr) == SQLITE_OK) {
             sqlite3_bind_text(stmt, 1, to,   -1, SQLITE_TRANSIENT);
             sqlite3_bind_text(stmt, 2, from, -1, SQLITE_TRANSIENT);
             sqlite3_step(stmt);
@@ -771,7 +1778,7 @@ static int fs_rename(const char* from, const char* to) {
         const char* sql_chk =
             "UPDATE checksums SET path = ? WHERE path = ?;";
 
-        if (sqlite3_prepare_v2(meta_db, sql_chk, -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_prepare_v2(db, sql_chk, -1, &stmt, nullptr) == SQLITE_OK) {
             sqlite3_bind_text(stmt, 1, to,   -1, SQLITE_TRANSIENT);
             sqlite3_bind_text(stmt, 2, from, -1, SQLITE_TRANSIENT);
             sqlite3_step(stmt);
@@ -794,17 +1801,23 @@ static void add_append_only_dirs_from_csv(const char* csv) {
             item = "/" + item;  // make it absolute from FS root
         }
         append_only_dirs.push_back(item);
-        std::cout << "Append-only dir configured: " << item << std::endl;
+        LOGI("Append-only dir configured: " << item);
     }
 }
 
-// Scan argv (starting at index 2: after backing_root) for append_only_dirs=...
-// and remove that option from argv so FUSE doesn't see it.
-static void parse_append_only_option(int& argc, char* argv[]) {
+// Storage for "-o" lists we rewrote after pulling our own options out of them.
+static std::vector<std::string> rewritten_opts;
+
+// Scan argv (starting at index 2: after backing_root) for our custom options
+// (append_only_dirs=..., db_*=..., checksum=..., verify=...) and remove them from argv
+// so FUSE doesn't see them.
+// Returns false if an option value is invalid.
+static bool parse_custom_options(int& argc, char* argv[]) {
     // We assume:
     // argv[0] = prog
     // argv[1] = backing_root
     // argv[2] = mount_point or FUSE arg
+    rewritten_opts.reserve(argc);
     int i = 2;
     while (i < argc) {
         // Case 1: "-o", "append_only_dirs=logs,backups"
@@ -812,25 +1825,37 @@ static void parse_append_only_option(int& argc, char* argv[]) {
             const char* opt = argv[i + 1];
             const char* key = "append_only_dirs=";
             const char* pos = strstr(opt, key);
+            std::string rest;
             if (pos == opt) {
                 const char* csv = opt + strlen(key);
                 add_append_only_dirs_from_csv(csv);
+            } else {
+                // Case 1b: "-o", "db_journal=wal,db_sync=normal,..."
+                if (!strip_shared_options(opt, rest, parse_metadatafs_option)) return false;
+                if (rest == opt) { i += 2; continue; } // nothing of ours
+            }
 
-                // Remove opt (argv[i+1])
-                for (int j = i + 1; j < argc - 1; ++j) {
-                    argv[j] = argv[j + 1];
-                }
-                --argc;
+            if (!rest.empty()) {
+                rewritten_opts.push_back(rest);
+                argv[i + 1] = &rewritten_opts.back()[0];
+                i += 2;
+                continue;
+            }
 
-                // Remove "-o" (argv[i])
-                for (int j = i; j < argc - 1; ++j) {
-                    argv[j] = argv[j + 1];
-                }
-                --argc;
+            // Remove opt (argv[i+1])
+            for (int j = i + 1; j < argc - 1; ++j) {
+                argv[j] = argv[j + 1];
+            }
+            --argc;
 
-                // Don't advance i; new arg now sits at position i
-                continue;
+            // Remove "-o" (argv[i])
+            for (int j = i; j < argc - 1; ++j) {
+                argv[j] = argv[j + 1];
             }
+            --argc;
+
+            // Don't advance i; new arg now sits at position i
+            continue;
         }
 
         // Case 2: "-oappend_only_dirs=logs,backups"
@@ -847,18 +1872,37 @@ static void parse_append_only_option(int& argc, char* argv[]) {
             continue;
         }
 
+        // Case 3: "-odb_journal=wal,..."
+        if (strncmp(argv[i], "-o", 2) == 0) {
+            std::string rest;
+            if (!strip_shared_options(argv[i] + 2, rest, parse_metadatafs_option)) return false;
+            if (rest.empty()) {
+                for (int j = i; j < argc - 1; ++j) {
+                    argv[j] = argv[j + 1];
+                }
+                --argc;
+                continue;
+            }
+            if (rest != argv[i] + 2) {
+                rewritten_opts.push_back("-o" + rest);
+                argv[i] = &rewritten_opts.back()[0];
+            }
+        }
+
         ++i;
     }
+    return true;
 }
 
 /*
  * fs_mkdir: create a directory in the backing store
  */
 static int fs_mkdir(const char* path, mode_t mode) {
-    std::string real = full_path(path);
-    std::cout << "fs_mkdir: " << path << " -> " << real << std::endl;
+    LOGD("fs_mkdir: " << path);
 
-    if (mkdir(real.c_str(), mode) == -1) {
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (mkdirat(at.fd(), at.name, mode) == -1) {
         return -errno;
     }
     return 0;
@@ -868,12 +1912,14 @@ static int fs_mkdir(const char* path, mode_t mode) {
  * fs_rmdir: remove a directory
  */
 static int fs_rmdir(const char* path) {
-    std::string real = full_path(path);
-    std::cout << "fs_rmdir: " << path << " -> " << real << std::endl;
+    LOGD("fs_rmdir: " << path);
 
-    if (rmdir(real.c_str()) == -1) {
+    AtPath at;
+    if (int rc = at_path(path, at)) return rc;
+    if (unlinkat(at.fd(), at.name, AT_REMOVEDIR) == -1) {
         return -errno;
     }
+    backing_dir_invalidate(path);
     return 0;
 }
 
@@ -893,7 +1939,10 @@ void set_fs_ops() {
     fs_ops.open     = fs_open;
     fs_ops.read     = fs_read;
     fs_ops.write    = fs_write;
+    fs_ops.read_buf  = fs_read_buf;
+    fs_ops.write_buf = fs_write_buf;
     fs_ops.release  = fs_release;
+    fs_ops.copy_file_range = fs_copy_file_range;
 
     fs_ops.create   = fs_create;
     fs_ops.unlink   = fs_unlink;
@@ -920,9 +1969,16 @@ int main(int argc, char* argv[]) {
     }
 
     backing_root = argv[1];
+    if (int rc = backing_open_root(backing_root)) {
+        std::cerr << "Cannot open backing directory " << backing_root
+                  << ": " << strerror(-rc) << "\n";
+        return 1;
+    }
 
-    // Parse and strip our custom append-only option
-    parse_append_only_option(argc, argv);
+    // Parse and strip our custom options (append-only dirs, DB tuning)
+    if (!parse_custom_options(argc, argv)) {
+        return 1;
+    }
     // After this, backing_root is still argv[1], but the -o append_only_dirs=... args are gone.
 
     // Shift args left so FUSE sees: prog <mount_point> [options...]
@@ -939,6 +1995,11 @@ int main(int argc, char* argv[]) {
     if (!append_only_dirs.empty()) {
         std::cout << "Append-only dirs enabled.\n";
     }
+    std::cout << "Metadata DB: journal=" << db_options.journal
+              << " sync=" << db_options.sync << "\n";
+    std::cout << "Checksum: " << checksum_name(checksum_algo) << "\n";
+    std::cout << "Read verification: " << (verify_mode == VERIFY_STREAM ? "stream" : "upfront") << "\n";
+    std::cout << "Log level: " << log_level_name(log_level) << "\n";
     std::cout << "=========================================\n";
 
     int fuse_ret = fuse_main(argc, argv, &fs_ops, NULL);
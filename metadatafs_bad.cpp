@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 29
+#define FUSE_USE_VERSION 31
 #define _FILE_OFFSET_BITS 64
 
 #include <fuse.h>
@@ -19,12 +19,14 @@
 #include <cstring>
 #include <iomanip>
 
+#include "checksum.h"
+#include "db_options.h"
+#include "fuse_conn.h"
+
 static sqlite3* meta_db = nullptr;
 static std::string backing_root;
 
-static std::unordered_map<int, uint64_t> checksum_map;
-static const uint64_t FNV_OFFSET_BASIS = 1469598103934665603ULL;
-static const uint64_t FNV_PRIME        = 1099511628211ULL;
+static std::unordered_map<int, uint64_t> checksum_map; // always checksum_algo
 
 static std::unordered_set<int> verified_ok_fds;
 static std::unordered_set<int> verified_bad_fds;
@@ -32,34 +34,22 @@ static std::vector<std::string> append_only_dirs;
 
 static bool is_append_only_path(const char* path);
 
-// Helper hash function
-static void update_fnv1a(uint64_t &hash, const char* buf, size_t size) {
-    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
-    for (size_t i = 0; i < size; ++i) {
-        hash ^= static_cast<uint64_t>(p[i]);
-        hash *= FNV_PRIME;
-    }
-}
-
 // Store checksum in DB
-static int store_checksum(const char* path, uint64_t hash) {
+static int store_checksum(const char* path, uint64_t hash, ChecksumAlgo algo) {
     if (!meta_db) return -EIO;
 
-    std::ostringstream oss;
-    oss << std::hex << hash;
-    std::string checksum = oss.str();
-
     const char* sql =
-        "INSERT INTO checksums(path, checksum) "
-        "VALUES(?, ?) "
-        "ON CONFLICT(path) DO UPDATE SET checksum = excluded.checksum;";
+        "INSERT INTO checksums(path, checksum, algo) "
+        "VALUES(?, ?, ?) "
+        "ON CONFLICT(path) DO UPDATE SET checksum = excluded.checksum, algo = excluded.algo;";
 
     sqlite3_stmt* stmt = nullptr;
     int rc = sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) return -EIO;
 
     sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, checksum.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)hash);
+    sqlite3_bind_int64(stmt, 3, algo);
 
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
@@ -76,33 +66,26 @@ static std::string full_path(const char* path) {
 }
 
 // Compute raw hash from disk
-static uint64_t compute_hash_uint64(const std::string& real_path) {
+static uint64_t compute_hash_uint64(const std::string& real_path, ChecksumAlgo algo) {
     int fd = open(real_path.c_str(), O_RDONLY);
-    if (fd == -1) return FNV_OFFSET_BASIS;
+    if (fd == -1) return checksum_init(algo);
 
-    uint64_t hash = FNV_OFFSET_BASIS;
+    uint64_t hash = checksum_init(algo);
     char buf[4096];
     ssize_t n;
     while ((n = read(fd, buf, sizeof(buf))) > 0) {
-        update_fnv1a(hash, buf, (size_t)n);
+        checksum_update(algo, hash, buf, (size_t)n);
     }
     close(fd);
     return hash;
 }
 
-static std::string compute_checksum_for_file(const std::string& real_path) {
-    uint64_t hash = compute_hash_uint64(real_path);
-    std::ostringstream oss;
-    oss << std::hex << hash;
-    return oss.str();
-}
-
 static bool verify_fd_checksum(const char* path, int fd) {
     if (verified_ok_fds.count(fd)) return true;
     if (verified_bad_fds.count(fd)) return false;
     if (!meta_db) { verified_ok_fds.insert(fd); return true; }
 
-    const char* sql = "SELECT checksum FROM checksums WHERE path = ?;";
+    const char* sql = "SELECT checksum, algo FROM checksums WHERE path = ?;";
     sqlite3_stmt* stmt = nullptr;
     if (sqlite3_prepare_v2(meta_db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
         verified_ok_fds.insert(fd); return true;
@@ -117,14 +100,18 @@ static bool verify_fd_checksum(const char* path, int fd) {
         return true;
     }
 
-    const unsigned char* checksum_text = sqlite3_column_text(stmt, 0);
-    std::string stored_checksum = checksum_text ? reinterpret_cast<const char*>(checksum_text) : "";
+    bool has_checksum = sqlite3_column_type(stmt, 0) != SQLITE_NULL;
+    uint64_t stored_checksum = (uint64_t)sqlite3_column_int64(stmt, 0);
+    int64_t algo_id = sqlite3_column_int64(stmt, 1);
     sqlite3_finalize(stmt);
 
-    if (stored_checksum.empty()) { verified_ok_fds.insert(fd); return true; }
+    if (!has_checksum) { verified_ok_fds.insert(fd); return true; }
+
+    ChecksumAlgo algo;
+    if (!checksum_from_id(algo_id, algo)) { verified_bad_fds.insert(fd); return false; }
 
     std::string real = full_path(path);
-    std::string current = compute_checksum_for_file(real);
+    uint64_t current = compute_hash_uint64(real, algo);
 
     if (current == stored_checksum) {
         verified_ok_fds.insert(fd);
@@ -137,7 +124,7 @@ static bool verify_fd_checksum(const char* path, int fd) {
 
 // --- FUSE Ops ---
 
-static int fs_getattr(const char* path, struct stat* st) {
+static int fs_getattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
     memset(st, 0, sizeof(struct stat));
     std::string real = full_path(path);
     if (lstat(real.c_str(), st) == -1) return -errno;
@@ -145,17 +132,17 @@ static int fs_getattr(const char* path, struct stat* st) {
 }
 
 static int fs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
-                      off_t offset, struct fuse_file_info* fi) {
-    (void) offset; (void) fi;
+                      off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
+    (void) offset; (void) fi; (void) flags;
     std::string real = full_path(path);
     DIR* dp = opendir(real.c_str());
     if (dp == nullptr) return -errno;
-    filler(buf, ".",  nullptr, 0);
-    filler(buf, "..", nullptr, 0);
+    filler(buf, ".",  nullptr, 0, (fuse_fill_dir_flags)0);
+    filler(buf, "..", nullptr, 0, (fuse_fill_dir_flags)0);
     struct dirent* de;
     while ((de = readdir(dp)) != nullptr) {
         if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-        if (filler(buf, de->d_name, nullptr, 0) != 0) { closedir(dp); return -ENOMEM; }
+        if (filler(buf, de->d_name, nullptr, 0, (fuse_fill_dir_flags)0) != 0) { closedir(dp); return -ENOMEM; }
     }
     closedir(dp);
     return 0;
@@ -164,14 +151,14 @@ static int fs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
 static int fs_open(const char* path, struct fuse_file_info* fi) {
     if (is_append_only_path(path) && (fi->flags & O_TRUNC)) return -EPERM;
     std::string real = full_path(path);
-    int fd = open(real.c_str(), fi->flags);
+    int fd = open(real.c_str(), backing_open_flags(fi->flags));
     if (fd == -1) return -errno;
     fi->fh = fd;
     verified_ok_fds.erase(fd);
     verified_bad_fds.erase(fd);
     int accmode = fi->flags & O_ACCMODE;
     if (accmode == O_WRONLY || accmode == O_RDWR) {
-        checksum_map[fd] = FNV_OFFSET_BASIS;
+        checksum_map[fd] = checksum_init(checksum_algo);
     }
     return 0;
 }
@@ -192,11 +179,11 @@ static int fs_write(const char* path, const char* buf, size_t size,
     int fd = static_cast<int>(fi->fh);
     auto it = checksum_map.find(fd);
     if (it != checksum_map.end()) {
-        update_fnv1a(it->second, buf, size);
+        checksum_update(checksum_algo, it->second, buf, size);
         
         // --- BAD ARCHITECTURE SIMULATION ---
         // Writing to DB on every 4KB chunk
-        store_checksum(path, it->second);
+        store_checksum(path, it->second, checksum_algo);
     }
     ssize_t res = pwrite(fd, buf, size, offset);
     if (res == -1) return -errno;
@@ -219,20 +206,20 @@ static int fs_release(const char* path, struct fuse_file_info* fi) {
 
 static int fs_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
     std::string real = full_path(path);
-    int fd = open(real.c_str(), fi->flags, mode);
+    int fd = open(real.c_str(), backing_open_flags(fi->flags), mode);
     if (fd == -1) return -errno;
     fi->fh = fd;
     int accmode = fi->flags & O_ACCMODE;
-    if (accmode == O_WRONLY || accmode == O_RDWR) checksum_map[fd] = FNV_OFFSET_BASIS;
+    if (accmode == O_WRONLY || accmode == O_RDWR) checksum_map[fd] = checksum_init(checksum_algo);
     return 0;
 }
 
-static int fs_truncate(const char* path, off_t size) {
+static int fs_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
     if (is_append_only_path(path)) return -EPERM;
     std::string real = full_path(path);
     if (truncate(real.c_str(), size) == -1) return -errno;
-    uint64_t new_hash = compute_hash_uint64(real);
-    store_checksum(path, new_hash); 
+    uint64_t new_hash = compute_hash_uint64(real, checksum_algo);
+    store_checksum(path, new_hash, checksum_algo); 
     return 0;
 }
 
@@ -253,7 +240,8 @@ static int fs_mkdir(const char* path, mode_t mode) {
 static int fs_rmdir(const char* path) {
     return rmdir(full_path(path).c_str()) == -1 ? -errno : 0;
 }
-static int fs_rename(const char* from, const char* to) {
+static int fs_rename(const char* from, const char* to, unsigned int flags) {
+    if (flags) return -EINVAL;
     return rename(full_path(from).c_str(), full_path(to).c_str()) == -1 ? -errno : 0;
 }
 static int fs_setxattr(const char* path, const char* name, const char* value, size_t size, int flags) {
@@ -288,9 +276,17 @@ void set_fs_ops() {
     fs_ops.listxattr = fs_listxattr;
 }
 
-static void* fs_init(struct fuse_conn_info* conn) {
+static void* fs_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    // No writeback cache: fs_write hashes in arrival order and ignores the
+    // offset, which only holds while writes arrive as the application made them
+    writeback_wanted = false;
+    negotiate_fuse_conn(conn, cfg);
     if (sqlite3_open((backing_root + "/.metadata.db").c_str(), &meta_db) != SQLITE_OK) return nullptr;
-    sqlite3_exec(meta_db, "CREATE TABLE IF NOT EXISTS checksums (path TEXT PRIMARY KEY, checksum TEXT);", NULL, NULL, NULL);
+    apply_db_options(meta_db);
+    const char* checksums_sql = "CREATE TABLE IF NOT EXISTS checksums (path TEXT PRIMARY KEY, checksum INTEGER, algo INTEGER NOT NULL DEFAULT 0);";
+    sqlite3_exec(meta_db, checksums_sql, NULL, NULL, NULL);
+    sqlite3_exec(meta_db, "ALTER TABLE checksums ADD COLUMN algo INTEGER NOT NULL DEFAULT 0;", NULL, NULL, NULL);
+    migrate_checksum_column(meta_db, "checksums", checksums_sql);
     return nullptr;
 }
 static void fs_destroy(void* private_data) {
@@ -318,31 +314,45 @@ static void add_append_only_dirs_from_csv(const char* csv) {
     }
 }
 
-static void parse_append_only_option(int& argc, char* argv[]) {
+static std::vector<std::string> rewritten_opts;
+
+static bool parse_custom_options(int& argc, char* argv[]) {
+    rewritten_opts.reserve(argc);
     int i = 2;
     while (i < argc) {
         if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
             const char* opt = argv[i + 1];
             const char* key = "append_only_dirs=";
             const char* pos = strstr(opt, key);
+            std::string rest;
             if (pos == opt) {
                 const char* csv = opt + strlen(key);
                 add_append_only_dirs_from_csv(csv);
-                for (int j = i + 1; j < argc - 1; ++j) argv[j] = argv[j + 1];
-                --argc;
-                for (int j = i; j < argc - 1; ++j) argv[j] = argv[j + 1];
-                --argc;
+            } else {
+                if (!strip_shared_options(opt, rest, parse_fuse_conn_option)) return false;
+                if (rest == opt) { i += 2; continue; }
+            }
+            if (!rest.empty()) {
+                rewritten_opts.push_back(rest);
+                argv[i + 1] = &rewritten_opts.back()[0];
+                i += 2;
                 continue;
             }
+            for (int j = i + 1; j < argc - 1; ++j) argv[j] = argv[j + 1];
+            --argc;
+            for (int j = i; j < argc - 1; ++j) argv[j] = argv[j + 1];
+            --argc;
+            continue;
         }
         ++i;
     }
+    return true;
 }
 
 int main(int argc, char* argv[]) {
     if (argc < 3) return 1;
     backing_root = argv[1];
-    parse_append_only_option(argc, argv);
+    if (!parse_custom_options(argc, argv)) return 1;
     for (int i = 1; i < argc - 1; ++i) argv[i] = argv[i + 1];
     --argc;
     
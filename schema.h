@@ -0,0 +1,179 @@
+// schema.h - checksum tables of .metadata.db, shared by metadatafs, blockfs
+// and augmentfs-fsck.
+//
+// Whole-file schema (metadatafs): one `checksums` row per file, holding the
+// checksum of its whole content and the stat fingerprint it was taken at.
+// Per-block schema (blockfs): one `files` row per file, one `block_hashes` row
+// per BLOCK_SIZE block, and the Merkle nodes built over them.
+// Both can live in the same DB. The create_*_schema() functions also bring an
+// existing DB up to date, including the one-time conversions of older layouts.
+#pragma once
+
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "db_options.h"
+#include "log.h"
+
+static const size_t BLOCK_SIZE = 4096; // 4KB Blocks (Standard Page Size)
+
+// Stat fingerprint of a backing file, stored next to what was computed from it.
+// While the file still matches it, that result still describes the file:
+// metadatafs resumes an append from the stored checksum, blockfs trusts a scrub.
+struct FileFingerprint {
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    int64_t ino;
+
+    bool operator==(const FileFingerprint& o) const {
+        return size == o.size && mtime_ns == o.mtime_ns &&
+               ctime_ns == o.ctime_ns && ino == o.ino;
+    }
+};
+
+static inline FileFingerprint fingerprint_of(const struct stat& st) {
+    return {
+        (int64_t)st.st_size,
+        (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+        (int64_t)st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec,
+        (int64_t)st.st_ino,
+    };
+}
+
+// --- Whole-file schema ---
+
+// checksum holds the 64-bit hash bit-cast to a signed INTEGER
+static const char* const CHECKSUMS_SQL =
+    "CREATE TABLE IF NOT EXISTS checksums ("
+    "  path TEXT PRIMARY KEY,"
+    "  checksum INTEGER,"
+    "  algo INTEGER NOT NULL DEFAULT 0,"
+    "  size INTEGER,"       // fingerprint of the file the checksum covers,
+    "  mtime_ns INTEGER,"   // NULL if unknown (see FileFingerprint)
+    "  ctime_ns INTEGER,"
+    "  ino INTEGER,"
+    "  verified_at INTEGER" // unix seconds of the last scrub that matched it
+    ");";
+
+static int create_checksums_schema(sqlite3* db) {
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, CHECKSUMS_SQL, nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LOGE("sqlite3_exec failed: " << errmsg);
+        sqlite3_free(errmsg);
+        return -1;
+    }
+
+    // DBs from before the algo column: every existing checksum is FNV-1a (algo 0).
+    // Fails harmlessly with "duplicate column" once the column exists.
+    sqlite3_exec(db, "ALTER TABLE checksums ADD COLUMN algo INTEGER NOT NULL DEFAULT 0;",
+                 nullptr, nullptr, nullptr);
+
+    // DBs from before fingerprints: rows start without one and get it on their next store
+    for (const char* col : {"size", "mtime_ns", "ctime_ns", "ino"}) {
+        std::string alter = std::string("ALTER TABLE checksums ADD COLUMN ") + col + " INTEGER;";
+        sqlite3_exec(db, alter.c_str(), nullptr, nullptr, nullptr);
+    }
+    sqlite3_exec(db, "ALTER TABLE checksums ADD COLUMN verified_at INTEGER;",
+                 nullptr, nullptr, nullptr);
+
+    // DBs from before binary checksums: convert hex TEXT once
+    return migrate_checksum_column(db, "checksums", CHECKSUMS_SQL) != 0 ? -1 : 0;
+}
+
+// --- Per-block schema ---
+
+// AUTOINCREMENT: an ID is never reused, so nothing keyed by a dead ID can alias a new file
+// verified_at and the verified_* fingerprint describe the file as the last
+// scrub that matched every block saw it.
+static const char* const FILES_SQL =
+    "CREATE TABLE IF NOT EXISTS files (file_id INTEGER PRIMARY KEY AUTOINCREMENT, path TEXT NOT NULL UNIQUE,"
+    " merkle_root INTEGER, merkle_algo INTEGER, merkle_blocks INTEGER, verified_at INTEGER,"
+    " verified_size INTEGER, verified_mtime_ns INTEGER, verified_ctime_ns INTEGER, verified_ino INTEGER);";
+
+// checksum holds the 64-bit hash bit-cast to a signed INTEGER.
+// WITHOUT ROWID: the (file_id, block_index) key is the table, no separate index.
+static const char* const BLOCK_HASHES_SQL =
+    "CREATE TABLE IF NOT EXISTS block_hashes ("
+    "  file_id INTEGER NOT NULL,"
+    "  block_index INTEGER NOT NULL,"
+    "  checksum INTEGER,"
+    "  algo INTEGER NOT NULL DEFAULT 0,"
+    "  PRIMARY KEY(file_id, block_index)"
+    ") WITHOUT ROWID;";
+
+// Interior Merkle nodes; level 1 covers MERKLE_FANOUT blocks, the root is in `files`
+static const char* const MERKLE_NODES_SQL =
+    "CREATE TABLE IF NOT EXISTS merkle_nodes ("
+    "  file_id INTEGER NOT NULL,"
+    "  level INTEGER NOT NULL,"
+    "  node_index INTEGER NOT NULL,"
+    "  checksum INTEGER,"
+    "  algo INTEGER NOT NULL,"
+    "  PRIMARY KEY(file_id, level, node_index)"
+    ") WITHOUT ROWID;";
+
+// Older DBs key block_hashes by (path, block_index), with INTEGER or hex TEXT
+// checksums. Give every path a `files` row and rebuild the table keyed by its ID,
+// in one transaction so an interrupted conversion leaves the old table untouched.
+static int migrate_block_hashes_to_file_ids(sqlite3* db) {
+    bool path_keyed = false;
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "PRAGMA table_info(block_hashes);", -1, &stmt, nullptr) != SQLITE_OK) {
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (strcmp(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)), "path") == 0) {
+            path_keyed = true;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (!path_keyed) return 0;
+
+    LOGI("Converting table block_hashes: path keys -> file IDs");
+    register_hex_to_int64(db);
+    std::string sql = std::string(
+        "BEGIN IMMEDIATE;"
+        "ALTER TABLE block_hashes RENAME TO block_hashes_by_path;") +
+        BLOCK_HASHES_SQL +
+        "INSERT OR IGNORE INTO files(path) SELECT DISTINCT path FROM block_hashes_by_path;"
+        "INSERT INTO block_hashes(file_id, block_index, checksum, algo) "
+        "  SELECT f.file_id, b.block_index, hex_to_int64(b.checksum), b.algo "
+        "  FROM block_hashes_by_path b JOIN files f ON f.path = b.path;"
+        "DROP TABLE block_hashes_by_path;"
+        "COMMIT;";
+
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LOGE("migrate_block_hashes_to_file_ids failed: "
+             << (errmsg ? errmsg : "?"));
+        sqlite3_free(errmsg);
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return -1;
+    }
+    return 0;
+}
+
+static int create_block_schema(sqlite3* db) {
+    sqlite3_exec(db, FILES_SQL, nullptr, nullptr, nullptr);
+    sqlite3_exec(db, BLOCK_HASHES_SQL, nullptr, nullptr, nullptr);
+    sqlite3_exec(db, MERKLE_NODES_SQL, nullptr, nullptr, nullptr);
+
+    // DBs from before the Merkle tree (or the scrubber): no file has a root yet.
+    // Each fails harmlessly with "duplicate column" once the column exists.
+    for (const char* col : {"merkle_root", "merkle_algo", "merkle_blocks", "verified_at",
+                            "verified_size", "verified_mtime_ns", "verified_ctime_ns", "verified_ino"}) {
+        std::string alter = std::string("ALTER TABLE files ADD COLUMN ") + col + " INTEGER;";
+        sqlite3_exec(db, alter.c_str(), nullptr, nullptr, nullptr);
+    }
+
+    // DBs from before the checksum column: every existing row is FNV-1a (algo 0).
+    // Fails harmlessly with "duplicate column" once the column exists.
+    sqlite3_exec(db, "ALTER TABLE block_hashes ADD COLUMN algo INTEGER NOT NULL DEFAULT 0;",
+                 nullptr, nullptr, nullptr);
+    // DBs from before file IDs (and possibly hex checksums): convert once
+    return migrate_block_hashes_to_file_ids(db);
+}
@@ -0,0 +1,219 @@
+// scrub.h - background integrity scrubbing, shared by metadatafs and blockfs.
+//
+// Mount options (passed with -o):
+//   scrub=on|off          run the scrubber (default: off)
+//   scrub_mbps=N          read budget in MiB/s (default: 50, 0 = unlimited)
+//   scrub_iops=N          read budget in reads/s (default: 200, 0 = unlimited)
+//   scrub_interval=SECS   pause between full passes (default: 86400)
+//
+// The scrubber is one thread, started from the init hook. It walks the files
+// that have stored checksums and re-reads them through the budget, so data
+// nobody reads still gets checked. Each filesystem supplies the pass itself.
+// This header holds what the two share: options, pacing, the thread, and
+// quarantine.
+//
+// Quarantine: a file that fails its check is moved, with its DB rows, into
+// /.quarantine in the backing directory, as if renamed through the mount. The
+// event is recorded in the `quarantine` table.
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sqlite3.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "log.h"
+#include "backing_at.h"
+
+static bool scrub_enabled = false;
+static unsigned long scrub_mbps = 50;
+static unsigned long scrub_iops = 200;
+static unsigned long scrub_interval = 86400;
+
+static const size_t SCRUB_READ_SIZE = 128 * 1024;  // bytes per budgeted read
+static const char* const QUARANTINE_DIR = "/.quarantine";
+
+static const char* const QUARANTINE_SQL =
+    "CREATE TABLE IF NOT EXISTS quarantine ("
+    "  id INTEGER PRIMARY KEY,"
+    "  path TEXT NOT NULL,"          // where the file was
+    "  moved_to TEXT NOT NULL,"      // where it is now (mount path)
+    "  detected_at INTEGER NOT NULL," // unix seconds
+    "  detail TEXT"
+    ");";
+
+// Try to consume one "key=value" mount option.
+// Returns 1 if consumed, 0 if the key is not ours, -1 if the value is invalid.
+static inline int parse_scrub_option(const std::string& key, const std::string& val) {
+    if (key == "scrub") {
+        if (val == "on")  { scrub_enabled = true;  return 1; }
+        if (val == "off") { scrub_enabled = false; return 1; }
+        return -1;
+    }
+    unsigned long* num = key == "scrub_mbps"     ? &scrub_mbps
+                       : key == "scrub_iops"     ? &scrub_iops
+                       : key == "scrub_interval" ? &scrub_interval
+                       : nullptr;
+    if (!num) return 0;
+    char* end = nullptr;
+    unsigned long v = strtoul(val.c_str(), &end, 10);
+    if (val.empty() || *end != '\0') return -1;
+    *num = v;
+    return 1;
+}
+
+// --- Scrubber thread ---
+
+struct ScrubThread {
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop = false;
+    bool running = false;
+    std::thread thread;
+};
+
+static ScrubThread scrub_thread;
+
+// Sleep until `t`. Returns false (early) if the scrubber is being stopped.
+static bool scrub_sleep_until(std::chrono::steady_clock::time_point t) {
+    std::unique_lock<std::mutex> lock(scrub_thread.mtx);
+    return !scrub_thread.cv.wait_until(lock, t, [] { return scrub_thread.stop; });
+}
+
+static bool scrub_stopping() {
+    std::lock_guard<std::mutex> lock(scrub_thread.mtx);
+    return scrub_thread.stop;
+}
+
+// Run `pass` now and then every scrub_interval seconds. Call from the FUSE init
+// hook, after the DB is up.
+static void scrub_start(void (*pass)()) {
+    if (!scrub_enabled) return;
+    LOGI("Scrubber: " << scrub_mbps << " MiB/s, " << scrub_iops << " reads/s, every "
+         << scrub_interval << "s");
+    scrub_thread.stop = false;
+    scrub_thread.thread = std::thread([pass] {
+        do {
+            pass();
+        } while (scrub_sleep_until(std::chrono::steady_clock::now() +
+                                   std::chrono::seconds(scrub_interval)));
+    });
+    scrub_thread.running = true;
+}
+
+// Interrupt the current pass and wait for the thread. Call from the FUSE destroy
+// hook, before the DB goes away.
+static void scrub_stop() {
+    if (!scrub_thread.running) return;
+    {
+        std::lock_guard<std::mutex> lock(scrub_thread.mtx);
+        scrub_thread.stop = true;
+    }
+    scrub_thread.cv.notify_all();
+    scrub_thread.thread.join();
+    scrub_thread.running = false;
+}
+
+// Paces reads to the MiB/s and reads/s budgets. One per pass.
+struct ScrubThrottle {
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+    // Wait until a read of `bytes` fits the budget. false = stopping.
+    bool charge(size_t bytes) {
+        using namespace std::chrono;
+        double secs = 0;
+        if (scrub_mbps) secs = std::max(secs, bytes / (scrub_mbps * 1048576.0));
+        if (scrub_iops) secs = std::max(secs, 1.0 / scrub_iops);
+        auto now = steady_clock::now();
+        if (next > now && !scrub_sleep_until(next)) return false;
+        next = std::max(next, now) + duration_cast<steady_clock::duration>(duration<double>(secs));
+        return !scrub_stopping();
+    }
+};
+
+// Read all of fd through the budget, handing each chunk to `fn(data, len)`.
+// Returns 0, -errno, or -EINTR if the scrubber is stopping.
+template <typename Fn>
+static int scrub_read_file(int fd, ScrubThrottle& throttle, Fn fn) {
+    static thread_local std::string buf(SCRUB_READ_SIZE, '\0');
+    off_t off = 0;
+    for (;;) {
+        if (!throttle.charge(SCRUB_READ_SIZE)) return -EINTR;
+        size_t done = 0;
+        while (done < SCRUB_READ_SIZE) {
+            ssize_t n = pread(fd, &buf[done], SCRUB_READ_SIZE - done, off + done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (n == 0) break;
+            done += n;
+        }
+        if (done > 0) fn(buf.data(), done);
+        if (done < SCRUB_READ_SIZE) return 0;
+        off += done;
+    }
+}
+
+// --- Quarantine ---
+
+// Already quarantined files are not scrubbed again
+static inline bool is_quarantine_path(const std::string& path) {
+    size_t n = strlen(QUARANTINE_DIR);
+    return path.compare(0, n, QUARANTINE_DIR) == 0 && (path.size() == n || path[n] == '/');
+}
+
+// Move the backing file of `path` under QUARANTINE_DIR. Returns its new mount
+// path, or "" if it could not be moved.
+static std::string quarantine_move(const char* path) {
+    int root = backing_root_dir->fd;
+    if (mkdirat(root, QUARANTINE_DIR + 1, 0700) == -1 && errno != EEXIST) {
+        LOGE("quarantine: cannot create " << QUARANTINE_DIR << ": " << strerror(errno));
+        return "";
+    }
+
+    // "/a/b.txt" -> "/.quarantine/<time>-a%b.txt", never replacing an earlier one
+    std::string flat(path + 1);
+    std::replace(flat.begin(), flat.end(), '/', '%');
+    if (flat.size() > 200) flat.erase(0, flat.size() - 200);  // stay under NAME_MAX
+    std::string base = std::string(QUARANTINE_DIR) + "/" + std::to_string((long long)time(nullptr)) + "-" + flat;
+
+    AtPath at;
+    if (at_path(path, at) != 0) return "";
+    for (int n = 0; n < 100; ++n) {
+        std::string to = n ? base + "." + std::to_string(n) : base;
+        if (renameat2(at.fd(), at.name, root, to.c_str() + 1, RENAME_NOREPLACE) == 0) return to;
+        if (errno != EEXIST) break;
+    }
+    LOGE("quarantine: cannot move " << path << ": " << strerror(errno));
+    return "";
+}
+
+// Append to the quarantine table. Caller owns `db` for the duration.
+static void quarantine_record(sqlite3* db, const char* path, const std::string& moved_to,
+                              const std::string& detail) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db,
+            "INSERT INTO quarantine(path, moved_to, detected_at, detail) VALUES(?, ?, ?, ?);",
+            -1, &stmt, nullptr) != SQLITE_OK) {
+        LOGE("quarantine_record: " << sqlite3_errmsg(db));
+        return;
+    }
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, moved_to.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(nullptr));
+    sqlite3_bind_text(stmt, 4, detail.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+}
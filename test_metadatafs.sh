@@ -180,7 +180,7 @@ cd "$ROOT"
 
 if mount | grep -q "$MOUNT"; then
     echo "  Unmounting $MOUNT..."
-    fusermount -u "$MOUNT"
+    fusermount3 -u "$MOUNT"
 fi
 
 if kill "$FS_PID" 2>/dev/null; then
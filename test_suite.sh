@@ -13,6 +13,43 @@ GREEN='\033[0;32m'
 RED='\033[0;31m'
 NC='\033[0m'
 
+# --- Helpers ---
+# mount_fs <binary> <backing> <mount> <options>: run a filesystem in the
+# foreground, in the background of this script; its log goes to <mount>.log
+mount_fs() {
+    $1 $2 $3 -f -o "$4" > "$3.log" 2>&1 &
+    FS_PID=$!
+    sleep 2 # Wait for mount to initialize
+    if ! mount | grep -q "$3"; then
+        echo -e "${RED}[ERROR] Mount of $3 failed!${NC}"
+        cat "$3.log"
+        exit 1
+    fi
+}
+
+unmount_fs() {
+    fusermount3 -u $1
+    wait $FS_PID 2>/dev/null || true
+}
+
+# Flip one byte of a backing file behind the filesystem's back
+corrupt_byte() {
+    printf 'X' | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# log_count <mount> <pattern>: lines matching <pattern> that the filesystem
+# mounted on <mount> has logged since it was mounted
+log_count() {
+    sleep 0.5 # log_level=debug lines reach the file from a background thread
+    grep -c -- "$2" "$1.log" || true
+}
+
+# We enable append-only for "logs" directory
+META_OPTS="append_only_dirs=logs"
+mount_meta() { mount_fs $FS_BIN $BACKING $MOUNT "$META_OPTS${1:+,$1}"; }
+unmount_meta() { unmount_fs $MOUNT; }
+remount_meta() { unmount_meta; mount_meta "$@"; }
+
 echo "=========================================="
 echo "    METADATA FS: FULL WORKFLOW TEST"
 echo "=========================================="
@@ -20,21 +57,13 @@ echo "=========================================="
 # Cleanup & Setup
 echo -e "\n[Step 1] Cleaning up previous runs..."
 # Use lazy unmount (-z) in case it's stuck
-fusermount -u -z $MOUNT 2>/dev/null || true
-rm -rf $BACKING $MOUNT
+fusermount3 -u -z $MOUNT 2>/dev/null || true
+rm -rf $BACKING $MOUNT $MOUNT.log
 mkdir -p $BACKING $MOUNT
 
 # Mount FS (Background)
 echo -e "[Step 2] Mounting File System..."
-# We enable append-only for "logs" directory
-$FS_BIN $BACKING $MOUNT -o append_only_dirs=logs -f &
-FS_PID=$!
-sleep 2 # Wait for mount to initialize
-
-if ! mount | grep -q "$MOUNT"; then
-    echo -e "${RED}[ERROR] Mount failed!${NC}"
-    exit 1
-fi
+mount_meta
 echo -e "${GREEN}[OK] Mounted successfully.${NC}"
 
 # Basic Write Test
@@ -121,8 +150,259 @@ else
     echo -e "${GREEN}[PASS] Blocked overwrite in /logs.${NC}"
 fi
 
+# Rename Test (Open Writer Follows the File)
+echo -e "\n[Step 9] Test: Rename Under an Open Writer"
+exec 3<> $MOUNT/moving.txt
+printf 'AAAA' >&3
+mv $MOUNT/moving.txt $MOUNT/moved.txt
+# A second writer on the new name; the first one's hash no longer covers the file
+printf 'BBBB' | dd of=$MOUNT/moved.txt bs=4 conv=notrunc 2>/dev/null
+exec 3>&-
+CONTENT=$(cat $MOUNT/moved.txt 2>/dev/null || true)
+if [ "$CONTENT" == "BBBB" ]; then
+    echo -e "${GREEN}[PASS] Checksum stored after release matches the renamed file.${NC}"
+else
+    echo -e "${RED}[FAIL] Expected 'BBBB' from the renamed file, got '$CONTENT'${NC}"
+    exit 1
+fi
+
+# Append Resume Test (Stored Fingerprint)
+echo -e "\n[Step 10] Test: Append After Remount Resumes the Stored Hash"
+printf "Before" > $MOUNT/resume.txt
+# A fresh mount has nothing cached; only the stored fingerprint can skip the rehash
+remount_meta log_level=debug
+printf "After" >> $MOUNT/resume.txt
+CONTENT=$(cat $MOUNT/resume.txt 2>/dev/null || true)
+if [ "$CONTENT" == "BeforeAfter" ] && [ "$(log_count $MOUNT 'Resumed hash for append')" == 1 ]; then
+    echo -e "${GREEN}[PASS] Append resumed from the stored hash and reads back verified.${NC}"
+else
+    echo -e "${RED}[FAIL] Append did not resume, or read back '$CONTENT'.${NC}"
+    exit 1
+fi
+
+# Verify Cache Test (Hit, then Out-of-Band Change)
+echo -e "\n[Step 11] Test: Verify Cache Skips an Unchanged File"
+echo "CachedData" > $MOUNT/cached.txt
+cat $MOUNT/cached.txt > /dev/null
+cat $MOUNT/cached.txt > /dev/null
+if [ "$(log_count $MOUNT 'verify_fd_checksum: OK for /cached.txt ')" == 1 ]; then
+    echo -e "${GREEN}[PASS] Second read of an unchanged file was not hashed again.${NC}"
+else
+    echo -e "${RED}[FAIL] Unchanged file was hashed on every read.${NC}"
+    exit 1
+fi
+
+# Same size and mtime as before: only the ctime can give the change away
+touch -r $BACKING/cached.txt $CURRENT_DIR/cached.stamp
+corrupt_byte $BACKING/cached.txt 0
+touch -r $CURRENT_DIR/cached.stamp $BACKING/cached.txt
+rm $CURRENT_DIR/cached.stamp
+if cat $MOUNT/cached.txt > /dev/null 2>&1; then
+    echo -e "${RED}[FAIL] Cached verdict outlived an out-of-band change.${NC}"
+    exit 1
+else
+    echo -e "${GREEN}[PASS] Out-of-band change dropped the cached verdict (EIO).${NC}"
+fi
+
+# Streaming Verification Test (verify=stream)
+echo -e "\n[Step 12] Test: Streaming Verification of a Sequential Read"
+SRC="$CURRENT_DIR/stream_src.bin"
+head -c 4000000 /dev/urandom > $SRC
+cp $SRC $MOUNT/stream_clean.bin
+cp $SRC $MOUNT/stream_bad.bin
+remount_meta log_level=debug,verify=stream
+corrupt_byte $BACKING/stream_bad.bin 3900000
+if cmp -s $SRC $MOUNT/stream_clean.bin; then
+    echo -e "${GREEN}[PASS] Clean file streams through verified.${NC}"
+else
+    echo -e "${RED}[FAIL] Streaming read of a clean file failed or differs.${NC}"
+    exit 1
+fi
+# The mismatch only shows once the pass reaches the end of the file
+if cat $MOUNT/stream_bad.bin > /dev/null 2>&1; then
+    echo -e "${RED}[FAIL] Streaming read of a corrupted file succeeded.${NC}"
+    exit 1
+else
+    echo -e "${GREEN}[PASS] Streaming read of a corrupted file failed (EIO).${NC}"
+fi
+rm -f $SRC
+
+# Page Cache Test (keep_cache)
+echo -e "\n[Step 13] Test: Kernel Pages Kept Only for a Verified, Unchanged File"
+echo "KeepMe" > $MOUNT/kept.txt
+cat $MOUNT/kept.txt > /dev/null # Not verified yet: pages dropped
+cat $MOUNT/kept.txt > /dev/null # Verified and unchanged: pages kept
+if [ "$(log_count $MOUNT 'keep_cache=0 for /kept.txt$')" == 1 ] &&
+   [ "$(log_count $MOUNT 'keep_cache=1 for /kept.txt$')" == 1 ]; then
+    echo -e "${GREEN}[PASS] Pages were kept only once the file was verified.${NC}"
+else
+    echo -e "${RED}[FAIL] Expected keep_cache=0 on the first open and 1 on the second.${NC}"
+    exit 1
+fi
+
+echo "Replaced" > $BACKING/kept.txt
+cat $MOUNT/kept.txt > /dev/null 2>&1 || true
+if [ "$(log_count $MOUNT 'keep_cache=0 for /kept.txt$')" == 2 ] &&
+   [ "$(log_count $MOUNT '/kept.txt changed since it was verified')" == 1 ]; then
+    echo -e "${GREEN}[PASS] Out-of-band change dropped the kernel's pages.${NC}"
+else
+    echo -e "${RED}[FAIL] Stale pages were kept after an out-of-band change.${NC}"
+    exit 1
+fi
+
+# Cleanup
+echo -e "\n[Step 14] Teardown"
+unmount_meta
+
+echo "=========================================="
+echo "    BLOCK FS: DURABILITY & INTEGRITY"
+echo "=========================================="
+
+BFS_BIN="./blockfs"
+FSCK_BIN="./augmentfs-fsck"
+BBACKING="$CURRENT_DIR/block_backing_dir"
+BMOUNT="$CURRENT_DIR/block_mount_point"
+
+# A long commit window: only fsync and close commit block hashes
+BLOCK_OPTS="commit_window_ms=600000"
+mount_block() { mount_fs $BFS_BIN $BBACKING $BMOUNT "$BLOCK_OPTS${1:+,$1}"; }
+unmount_block() { unmount_fs $BMOUNT; }
+remount_block() { unmount_block; mount_block "$@"; }
+
+echo -e "\n[Step 15] Mounting BlockFS..."
+fusermount3 -u -z $BMOUNT 2>/dev/null || true
+rm -rf $BBACKING $BMOUNT $BMOUNT.log
+mkdir -p $BBACKING $BMOUNT
+mount_block
+echo -e "${GREEN}[OK] Mounted successfully.${NC}"
+
+# Crash Test (fsync commits the open hash batch)
+echo -e "\n[Step 16] Test: fsync Survives a Crash"
+# Write and fsync, then kill the daemon while the file is still open,
+# so the close that would also commit never happens
+python3 - "$BMOUNT/durable.bin" "$FS_PID" <<'PY'
+import os, signal, sys
+fd = os.open(sys.argv[1], os.O_WRONLY | os.O_CREAT, 0o644)
+os.write(fd, b"D" * 16384)
+os.fsync(fd)
+os.kill(int(sys.argv[2]), signal.SIGKILL)
+PY
+wait $FS_PID 2>/dev/null || true
+fusermount3 -u -z $BMOUNT 2>/dev/null || true
+
+# fsck lists a file with no stored block hashes as UNSEALED
+if $FSCK_BIN --schema=block $BBACKING | grep -q '^UNSEALED /durable.bin'; then
+    echo -e "${RED}[FAIL] Hashes written before fsync were lost in the crash.${NC}"
+    exit 1
+else
+    echo -e "${GREEN}[PASS] Hashes were durable after fsync.${NC}"
+fi
+mount_block
+rm $BMOUNT/durable.bin
+
+# Merkle Root Test (getfattr)
+echo -e "\n[Step 17] Test: Merkle Root Across Remount"
+head -c 300000 /dev/urandom > $BMOUNT/tree.bin
+ROOT1=$(getfattr -n user.blockfs.merkle_root --only-values $BMOUNT/tree.bin 2>/dev/null || true)
+remount_block
+ROOT2=$(getfattr -n user.blockfs.merkle_root --only-values $BMOUNT/tree.bin 2>/dev/null || true)
+if [ -n "$ROOT1" ] && [ "$ROOT1" == "$ROOT2" ]; then
+    echo -e "${GREEN}[PASS] Root is stable across remount ($ROOT1).${NC}"
+else
+    echo -e "${RED}[FAIL] Root changed across remount: '$ROOT1' vs '$ROOT2'${NC}"
+    exit 1
+fi
+
+printf 'changed' | dd of=$BMOUNT/tree.bin bs=1 seek=150000 conv=notrunc 2>/dev/null
+ROOT3=$(getfattr -n user.blockfs.merkle_root --only-values $BMOUNT/tree.bin 2>/dev/null || true)
+if [ -n "$ROOT3" ] && [ "$ROOT3" != "$ROOT2" ]; then
+    echo -e "${GREEN}[PASS] Root follows a write ($ROOT3).${NC}"
+else
+    echo -e "${RED}[FAIL] Root did not change after a write: '$ROOT3'${NC}"
+    exit 1
+fi
+rm $BMOUNT/tree.bin
+
+# Scrub Test (Quarantine)
+echo -e "\n[Step 18] Test: Scrub Quarantines a Corrupted File"
+head -c 200000 /dev/urandom > $BMOUNT/victim.bin
+unmount_block
+corrupt_byte $BBACKING/victim.bin 70000
+# The first pass starts at mount; no budget, so it is done well within the wait
+mount_block "scrub=on,scrub_mbps=0,scrub_iops=0"
+sleep 1
+if [ ! -e $BMOUNT/victim.bin ] && ls $BBACKING/.quarantine/*-%victim.bin > /dev/null 2>&1; then
+    echo -e "${GREEN}[PASS] Corrupted file was moved to .quarantine.${NC}"
+else
+    echo -e "${RED}[FAIL] Scrub did not quarantine the corrupted file.${NC}"
+    exit 1
+fi
+unmount_block
+
+# Offline Seal & Verify Test (augmentfs-fsck)
+echo -e "\n[Step 19] Test: fsck --seal, then Verify"
+# fsck only runs on an unmounted backing directory
+head -c 500000 /dev/urandom > $BBACKING/sealed.bin
+$FSCK_BIN --seal $BBACKING > /dev/null
+if $FSCK_BIN $BBACKING > /dev/null; then
+    echo -e "${GREEN}[PASS] Sealed tree verifies clean.${NC}"
+else
+    echo -e "${RED}[FAIL] Verify reported problems right after --seal.${NC}"
+    exit 1
+fi
+
+corrupt_byte $BBACKING/sealed.bin 250000
+if $FSCK_BIN $BBACKING > /dev/null; then
+    echo -e "${RED}[FAIL] Verify missed a corrupted block.${NC}"
+    exit 1
+else
+    echo -e "${GREEN}[PASS] Verify caught the corrupted block.${NC}"
+fi
+rm $BBACKING/sealed.bin
+mount_block
+
+# Truncate Test (Mid-Block)
+echo -e "\n[Step 20] Test: Truncate to Mid-Block, then Read"
+SRC="$CURRENT_DIR/truncate_src.bin"
+head -c 20000 /dev/urandom > $SRC
+cp $SRC $BMOUNT/cut.bin
+truncate -s 6000 $BMOUNT/cut.bin
+# The cut block is rehashed: reading it must not look like corruption,
+# before or after the hashes come back from the DB
+for PASS in live remount; do
+    if [ $PASS == remount ]; then
+        remount_block
+    fi
+    if cmp -s <(head -c 6000 $SRC) $BMOUNT/cut.bin; then
+        echo -e "${GREEN}[PASS] Truncated file reads back its first 6000 bytes ($PASS).${NC}"
+    else
+        echo -e "${RED}[FAIL] Read after a mid-block truncate failed or differs ($PASS).${NC}"
+        exit 1
+    fi
+done
+rm -f $SRC
+
+# Parallel Hashing Test (hash_threads)
+echo -e "\n[Step 21] Test: Multi-MiB Writes Hashed on Several Threads"
+SRC="$CURRENT_DIR/parallel_src.bin"
+head -c 8000000 /dev/urandom > $SRC
+# Each 1 MiB write is hashed in slices on 4 threads, then again on 1
+remount_block hash_threads=4
+dd if=$SRC of=$BMOUNT/par4.bin bs=1M 2>/dev/null
+remount_block hash_threads=1
+dd if=$SRC of=$BMOUNT/par1.bin bs=1M 2>/dev/null
+remount_block
+ROOT4=$(getfattr -n user.blockfs.merkle_root --only-values $BMOUNT/par4.bin 2>/dev/null || true)
+ROOT1=$(getfattr -n user.blockfs.merkle_root --only-values $BMOUNT/par1.bin 2>/dev/null || true)
+if cmp -s $SRC $BMOUNT/par4.bin && [ -n "$ROOT4" ] && [ "$ROOT4" == "$ROOT1" ]; then
+    echo -e "${GREEN}[PASS] Reads back clean, same root as hash_threads=1 ($ROOT4).${NC}"
+else
+    echo -e "${RED}[FAIL] hash_threads=4 file differs or its root '$ROOT4' is not '$ROOT1'.${NC}"
+    exit 1
+fi
+rm -f $SRC $BMOUNT/par4.bin $BMOUNT/par1.bin
+
 # Cleanup
-echo -e "\n[Step 9] Teardown"
-kill $FS_PID
-fusermount -u $MOUNT
+echo -e "\n[Step 22] Teardown"
+unmount_block
 echo -e "${GREEN}ALL TESTS PASSED SUCCESSFULLY!${NC}"
\ No newline at end of file